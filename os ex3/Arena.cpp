@@ -0,0 +1,55 @@
+#include "Arena.h"
+#include <cstdint>
+#include <new>
+
+#define ARENA_BLOCK_BYTES (64 * 1024)
+
+Arena::Arena()
+        : current(nullptr)
+        , left(0)
+{
+}
+
+Arena::~Arena() {
+    for (size_t i = destructors.size(); i-- > 0;) {
+        destructors[i].second(destructors[i].first);
+    }
+    for (char* block : blocks) {
+        ::operator delete(block);
+    }
+}
+
+/**
+ * Returns how many bytes past p the next address aligned to alignment is.
+ */
+static size_t paddingFor(const char* p, size_t alignment) {
+    return (alignment - reinterpret_cast<uintptr_t>(p) % alignment) % alignment;
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    size_t padding = paddingFor(current, alignment);
+    if (padding + size > left) {
+        // New blocks are only aligned to max_align_t, so an over-aligned
+        // request needs room to be aligned in.
+        size_t slack = alignment > alignof(std::max_align_t) ? alignment - 1 : 0;
+        // A large request gets a block of its own, so the current block's
+        // tail is not wasted.
+        if (size + slack > ARENA_BLOCK_BYTES / 4) {
+            char* block = static_cast<char*>(::operator new(size + slack));
+            blocks.push_back(block);
+            return block + paddingFor(block, alignment);
+        }
+        current = static_cast<char*>(::operator new(ARENA_BLOCK_BYTES));
+        blocks.push_back(current);
+        left = ARENA_BLOCK_BYTES;
+        padding = paddingFor(current, alignment);
+    }
+    char* result = current + padding;
+    current = result + size;
+    left -= padding + size;
+    return result;
+}
+
+void Arena::registerDestructor(void* object, void (*destroy)(void*)) {
+    destructors.push_back(std::make_pair(object, destroy));
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * A bump allocator owned by a single thread at a time.
+ *
+ * Memory is carved out of large blocks with no locking and is never freed
+ * piecemeal: the destructor runs the registered destructors, newest first,
+ * then frees all the blocks at once.
+ */
+class Arena {
+public:
+    Arena();
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /**
+     * Returns size bytes aligned to alignment, which must be a power of two.
+     */
+    void* allocate(size_t size, size_t alignment);
+
+    /**
+     * Has destroy(object) run when the arena is destroyed.
+     */
+    void registerDestructor(void* object, void (*destroy)(void*));
+
+private:
+    std::vector<char*> blocks;
+    char* current;
+    size_t left;
+    std::vector<std::pair<void*, void (*)(void*)>> destructors;
+};
+
+#endif // ARENA_H
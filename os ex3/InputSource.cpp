@@ -0,0 +1,86 @@
+#include "InputSource.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SYSTEM_ERROR_PREFIX "system error: "
+#define INPUT_ERROR "failed to map the input file"
+#define EXIT_FAIL 1
+#define SIZE_SAMPLE_BYTES (64 * 1024)
+
+static void inputFailed() {
+    std::cerr << SYSTEM_ERROR_PREFIX << INPUT_ERROR << std::endl;
+    exit(EXIT_FAIL);
+}
+
+MappedFileSource::MappedFileSource(const char* path, char delimiter)
+        : data(nullptr)
+        , bytes(0)
+        , position(0)
+        , delimiter(delimiter)
+        , records(0)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        inputFailed();
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        inputFailed();
+    }
+    bytes = static_cast<size_t>(status.st_size);
+    if (bytes > 0) {
+        void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            inputFailed();
+        }
+        madvise(mapping, bytes, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
+    }
+    close(fd);
+    countRecords();
+}
+
+/**
+ * Sets records to the number of delimiters in the first SIZE_SAMPLE_BYTES,
+ * plus an unterminated last record, scaled up to the whole file when it is
+ * longer. A sample without a delimiter counts as one record.
+ */
+void MappedFileSource::countRecords() {
+    size_t sample = std::min<size_t>(bytes, SIZE_SAMPLE_BYTES);
+    uint64_t delimiters = std::count(data, data + sample, delimiter);
+    if (sample == bytes) {
+        records = delimiters + (bytes > 0 && data[bytes - 1] != delimiter);
+        return;
+    }
+    records = std::max<uint64_t>(1, delimiters) * bytes / sample;
+}
+
+MappedFileSource::~MappedFileSource() {
+    if (data) {
+        munmap(const_cast<char*>(data), bytes);
+    }
+}
+
+bool MappedFileSource::next(InputPair& pair) {
+    if (position >= bytes) {
+        return false;
+    }
+    const char* begin = data + position;
+    const void* end = memchr(begin, delimiter, bytes - position);
+    size_t size = end ? static_cast<const char*>(end) - begin : bytes - position;
+    pair = InputPair(nullptr, new FileRecord(begin, size, position));
+    position += size + 1;
+    return true;
+}
+
+void MappedFileSource::release(const InputPair& pair) {
+    delete static_cast<FileRecord*>(pair.second);
+}
@@ -0,0 +1,97 @@
+#ifndef INPUTSOURCE_H
+#define INPUTSOURCE_H
+#include "MapReduceClient.h"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Input of a MapReduce job that is pulled a record at a time while the job
+ * maps, instead of an InputVec built before it starts.
+ *
+ * The framework calls next from a thread of the job's own, never from the
+ * shared worker pool, and keeps a few batches of records per map worker
+ * pulled ahead. A source may thus produce its records lazily (reading a
+ * file, decoding a stream, waiting on a socket) without holding up other
+ * jobs, and only what the workers are mapping, or about to, has to be in
+ * memory. Once a record is mapped the framework hands it back through
+ * release, possibly from several threads at once.
+ */
+class InputSource {
+public:
+    virtual ~InputSource() { }
+
+    /**
+     * Stores the next record in pair and returns true, or returns false once
+     * the input is exhausted (next is not called again). May block until a
+     * record is available.
+     */
+    virtual bool next(InputPair& pair) = 0;
+
+    /**
+     * Called once the record has been mapped; the framework does not touch
+     * it afterwards. Does nothing by default.
+     */
+    virtual void release(const InputPair& pair) { }
+
+    /**
+     * Expected number of records, used only for getJobState's map progress;
+     * 0, the default, when unknown.
+     */
+    virtual uint64_t sizeHint() const { return 0; }
+};
+
+/**
+ * A record of a MappedFileSource: size bytes at data, found offset bytes
+ * into the file, delimiter excluded. Valid until the record is released.
+ */
+class FileRecord : public V1 {
+public:
+    FileRecord(const char* data, size_t size, uint64_t offset)
+        : data(data), size(size), offset(offset) { }
+
+    const char* data;
+    size_t size;
+    uint64_t offset;
+};
+
+/**
+ * Splits a file into delimiter-terminated records (the last one may lack
+ * its delimiter), read through a read-only mapping of the file.
+ *
+ * Records are found as workers ask for them, so mapping starts at once
+ * rather than after the file is read, and they point into the mapping
+ * rather than being copied. Their pages are read ahead sequentially and,
+ * being clean, can be dropped by the kernel once mapped. Each record comes
+ * as a null key and a FileRecord, deleted on release.
+ */
+class MappedFileSource : public InputSource {
+public:
+    /**
+     * Maps the file at path. Exits if it cannot be opened or mapped.
+     */
+    explicit MappedFileSource(const char* path, char delimiter = '\n');
+    ~MappedFileSource();
+    MappedFileSource(const MappedFileSource&) = delete;
+    MappedFileSource& operator=(const MappedFileSource&) = delete;
+
+    bool next(InputPair& pair) override;
+    void release(const InputPair& pair) override;
+
+    /**
+     * The number of records, counted when the file is opened if it is up to
+     * 64 KiB long, and otherwise estimated from its first 64 KiB as the file
+     * size over the average length of the records there.
+     */
+    uint64_t sizeHint() const override { return records; }
+
+private:
+    void countRecords();
+
+    const char* data;
+    size_t bytes;
+    size_t position;
+    char delimiter;
+    uint64_t records;
+};
+
+#endif // INPUTSOURCE_H
@@ -0,0 +1,723 @@
+#include "MapReduceFramework.h"
+#include "MapReduceJob.h"
+#include "WorkClaim.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define USAGE "usage: MapReduceBenchmark [shuffle|skew|arena|compare|template " \
+              "[pairs] " \
+              "[distinct_keys] [max_threads] | claim [items] [max_threads] | " \
+              "suite [csv|json] [max_pairs] [max_threads]]"
+#define DEFAULT_PAIRS 2000000
+#define DEFAULT_KEYS 500000
+#define DEFAULT_CLAIM_ITEMS 20000000
+#define DEFAULT_MAX_THREADS 64
+#define INPUT_SPLITS 1024
+#define SKEWED_SPLITS 8
+#define SUITE_DEFAULT_PAIRS 1000000
+#define SUITE_DEFAULT_MAX_THREADS 8
+#define SUITE_SIZES 3
+#define SUITE_SIZE_STEP 4
+#define SUITE_KEY_RATIO 4
+#define WORD_VOCABULARY 20000
+#define WORDS_PER_LINE 16
+#define ZIPF_EXPONENT 1.0
+#define LARGE_VALUE_BYTES 1024
+#define LARGE_VALUE_SCALE 16
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Integer key used as K2 and K3 by the benchmark workloads.
+ */
+class KInt : public K2, public K3 {
+public:
+    explicit KInt(uint64_t value) : value(value) { }
+    virtual bool operator<(const K2 &other) const {
+      return value < static_cast<const KInt&>(other).value;
+    }
+    virtual bool operator<(const K3 &other) const {
+      return value < static_cast<const KInt&>(other).value;
+    }
+    virtual bool normalizedPrefix(uint64_t &prefix, bool &exact) const {
+      prefix = value;
+      exact = true;
+      return true;
+    }
+    uint64_t value;
+};
+
+/**
+ * KInt without a normalized prefix, so the framework sorts it by comparing.
+ */
+class KIntCompared : public KInt {
+public:
+    explicit KIntCompared(uint64_t value) : KInt(value) { }
+    virtual bool normalizedPrefix(uint64_t &prefix, bool &exact) const {
+      return false;
+    }
+};
+
+/**
+ * What a shuffle sweep varies about the counting workload.
+ */
+struct Workload {
+    // the last SKEWED_SPLITS splits hold half of the pairs.
+    bool skewed;
+    // keys and values come from the job's arena.
+    bool arena;
+    // keys have no normalized prefix.
+    bool compared;
+};
+
+/**
+ * Count value used as V2 and V3 by the benchmark workloads.
+ */
+class VCount : public V2, public V3 {
+public:
+    explicit VCount(uint64_t count) : count(count) { }
+    uint64_t count;
+};
+
+/**
+ * One input split: emits `pairs` pseudo-random keys below `keys`.
+ */
+class VSplit : public V1 {
+public:
+    VSplit(uint64_t pairs, uint64_t keys, uint64_t seed)
+        : pairs(pairs), keys(keys), seed(seed) { }
+    uint64_t pairs;
+    uint64_t keys;
+    uint64_t seed;
+};
+
+/**
+ * Counts key occurrences with no artificial work in map or reduce, so the
+ * measured time is framework overhead: sorting, shuffling and bookkeeping.
+ * With `arena`, keys and values come from the job's arena (see jobNew) and
+ * are never deleted one by one. With `compared`, keys are KIntCompared.
+ */
+class CountClient : public MapReduceClient {
+public:
+    CountClient(bool arena, bool compared) : arena(arena), compared(compared) { }
+
+    void map(const K1* key, const V1* value, void* context) const {
+      const VSplit* split = static_cast<const VSplit*>(value);
+      uint64_t state = split->seed;
+      for (uint64_t i = 0; i < split->pairs; ++i) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t key = (state >> 33) % split->keys;
+        if (arena) {
+          emit2(jobNew<KInt>(context, key), jobNew<VCount>(context, 1), context);
+        } else if (compared) {
+          emit2(new KIntCompared(key), new VCount(1), context);
+        } else {
+          emit2(new KInt(key), new VCount(1), context);
+        }
+      }
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const {
+      uint64_t count = 0;
+      for (const IntermediatePair& pair : *pairs) {
+        count += static_cast<const VCount*>(pair.second)->count;
+      }
+      if (arena) {
+        emit3(static_cast<KInt*>(pairs->at(0).first),
+              jobNew<VCount>(context, count), context);
+        return;
+      }
+      for (const IntermediatePair& pair : *pairs) {
+        delete pair.second;
+      }
+      for (size_t i = 1; i < pairs->size(); ++i) {
+        delete (*pairs)[i].first;
+      }
+      emit3(static_cast<KInt*>(pairs->at(0).first), new VCount(count), context);
+    }
+
+    bool arena;
+    bool compared;
+};
+
+typedef MapReduceJob<int, VSplit, uint64_t, uint64_t, uint64_t, uint64_t>
+    CountJob;
+
+/**
+ * CountClient for MapReduceJob: the same counting over value-type keys.
+ */
+class TemplateCountClient {
+public:
+    void map(const int& key, const VSplit& split, CountJob::Context& context) const {
+      uint64_t state = split.seed;
+      for (uint64_t i = 0; i < split.pairs; ++i) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        context.emit2((state >> 33) % split.keys, 1);
+      }
+    }
+
+    void reduce(const CountJob::IntermediateVec& pairs,
+                CountJob::Context& context) const {
+      uint64_t count = 0;
+      for (const CountJob::IntermediatePair& pair : pairs) {
+        count += pair.second;
+      }
+      context.emit3(pairs.front().first, count);
+    }
+};
+
+/**
+ * Wall time, in milliseconds, that a job spent in each stage.
+ */
+struct StageTimes {
+    double map;
+    double shuffle;
+    double reduce;
+};
+
+/**
+ * Runs one job and reads its stage times from getJobMetrics. Deletes the
+ * output pairs unless they live in the job's arena.
+ */
+StageTimes runJob(const MapReduceClient& client, const InputVec& inputVec,
+                  int threads, bool arenaOutput)
+{
+  OutputVec outputVec;
+  JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads);
+  waitForJob(job);
+  JobMetrics metrics;
+  getJobMetrics(job, &metrics);
+  closeJobHandle(job);
+
+  if (!arenaOutput) {
+    for (OutputPair& pair : outputVec) {
+      delete pair.first;
+      delete pair.second;
+    }
+  }
+
+  StageTimes times;
+  times.map = metrics.mapMs;
+  times.shuffle = metrics.shuffleMs;
+  times.reduce = metrics.reduceMs;
+  return times;
+}
+
+/**
+ * Sweeps multiThreadLevel over powers of two and prints one CSV line per
+ * level. The shuffle column is the one to watch across framework changes:
+ * it should shrink as threads are added, not stay flat.
+ *
+ * A skewed workload stands for a few huge records trailing many tiny ones;
+ * the map column shows how well map work is balanced. With an arena, the
+ * reduce column includes releasing it. With compared keys, the map column
+ * includes sorting by comparison instead of by radix.
+ */
+int runShuffleBenchmark(int argc, char** argv, const Workload& workload)
+{
+  uint64_t pairs = argc > 0 ? std::strtoull(argv[0], nullptr, 10) : DEFAULT_PAIRS;
+  uint64_t keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_KEYS;
+  int maxThreads = argc > 2 ? std::atoi(argv[2]) : DEFAULT_MAX_THREADS;
+  if (argc > 3 || pairs == 0 || keys == 0 || maxThreads < 1) {
+    std::fprintf(stderr, "%s\n", USAGE);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<VSplit> splits;
+  splits.reserve(INPUT_SPLITS);
+  InputVec inputVec;
+  uint64_t small = workload.skewed ? pairs / 2 : pairs;
+  uint64_t smallSplits = workload.skewed ? INPUT_SPLITS - SKEWED_SPLITS
+                                         : INPUT_SPLITS;
+  for (uint64_t i = 0; i < INPUT_SPLITS; ++i) {
+    uint64_t share;
+    if (i < smallSplits) {
+      share = small / smallSplits + (i < small % smallSplits ? 1 : 0);
+    } else {
+      uint64_t j = i - smallSplits;
+      share = (pairs - small) / SKEWED_SPLITS +
+              (j < (pairs - small) % SKEWED_SPLITS ? 1 : 0);
+    }
+    splits.push_back(VSplit(share, keys, i + 1));
+  }
+  for (VSplit& split : splits) {
+    inputVec.push_back(InputPair(nullptr, &split));
+  }
+
+  CountClient client(workload.arena, workload.compared);
+  std::printf("threads,pairs,keys,map_ms,shuffle_ms,reduce_ms\n");
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    StageTimes times = runJob(client, inputVec, threads, client.arena);
+    std::printf("%d,%llu,%llu,%.3f,%.3f,%.3f\n", threads,
+                static_cast<unsigned long long>(pairs),
+                static_cast<unsigned long long>(keys),
+                times.map, times.shuffle, times.reduce);
+    std::fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Runs the counting workload through the virtual API and through
+ * MapReduceJob for 1, 2, 4, ... threads, and prints one CSV line per thread
+ * count with the total time of each.
+ */
+int runTemplateBenchmark(int argc, char** argv)
+{
+  uint64_t pairs = argc > 0 ? std::strtoull(argv[0], nullptr, 10) : DEFAULT_PAIRS;
+  uint64_t keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_KEYS;
+  int maxThreads = argc > 2 ? std::atoi(argv[2]) : DEFAULT_MAX_THREADS;
+  if (argc > 3 || pairs == 0 || keys == 0 || maxThreads < 1) {
+    std::fprintf(stderr, "%s\n", USAGE);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<VSplit> splits;
+  splits.reserve(INPUT_SPLITS);
+  InputVec inputVec;
+  CountJob::InputVec jobInput;
+  for (uint64_t i = 0; i < INPUT_SPLITS; ++i) {
+    uint64_t share = pairs / INPUT_SPLITS + (i < pairs % INPUT_SPLITS ? 1 : 0);
+    splits.push_back(VSplit(share, keys, i + 1));
+    jobInput.push_back(CountJob::InputPair(0, splits.back()));
+  }
+  for (VSplit& split : splits) {
+    inputVec.push_back(InputPair(nullptr, &split));
+  }
+
+  typedef std::chrono::duration<double, std::milli> Millis;
+  CountClient client(false, false);
+  TemplateCountClient templateClient;
+  std::printf("threads,pairs,keys,virtual_ms,template_ms,speedup\n");
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    StageTimes times = runJob(client, inputVec, threads, false);
+    double virtualMs = times.map + times.shuffle + times.reduce;
+
+    CountJob::OutputVec outputVec;
+    Clock::time_point start = Clock::now();
+    CountJob::run(templateClient, jobInput, outputVec, threads);
+    double templateMs = Millis(Clock::now() - start).count();
+
+    std::printf("%d,%llu,%llu,%.3f,%.3f,%.2f\n", threads,
+                static_cast<unsigned long long>(pairs),
+                static_cast<unsigned long long>(keys), virtualMs, templateMs,
+                virtualMs / templateMs);
+    std::fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @enum SuiteKind
+ * @brief The synthetic workloads of the benchmark suite.
+ */
+enum SuiteKind {
+    WORD_COUNT,
+    UNIFORM_KEYS,
+    ZIPF_KEYS,
+    LARGE_VALUES,
+    TINY_RECORDS,
+    SUITE_KINDS
+};
+
+const char* const SUITE_NAMES[SUITE_KINDS] = {
+    "word_count", "uniform_keys", "zipf_keys", "large_values", "tiny_records"
+};
+
+/**
+ * Word used as K2 and K3 by the word count workload.
+ */
+class KWord : public K2, public K3 {
+public:
+    explicit KWord(const std::string& word) : word(word) { }
+    virtual bool operator<(const K2 &other) const {
+      return word < static_cast<const KWord&>(other).word;
+    }
+    virtual bool operator<(const K3 &other) const {
+      return word < static_cast<const KWord&>(other).word;
+    }
+    virtual bool normalizedPrefix(uint64_t &prefix, bool &exact) const {
+      prefix = 0;
+      for (size_t i = 0; i < sizeof(prefix); ++i) {
+        prefix = (prefix << 8) |
+                 (i < word.size() ? static_cast<unsigned char>(word[i]) : 0);
+      }
+      exact = false;
+      return true;
+    }
+    std::string word;
+};
+
+/**
+ * Opaque payload used as V2 by the large values workload.
+ */
+class VBlob : public V2 {
+public:
+    explicit VBlob(size_t bytes) : payload(bytes, 'x') { }
+    std::string payload;
+};
+
+/**
+ * One input record of a suite workload: a line of text for word count,
+ * otherwise the seed and number of pairs to generate, with keys below
+ * `keys` (drawn through `zipf`, a cumulative distribution, if set).
+ */
+class VRecord : public V1 {
+public:
+    VRecord() : pairs(0), keys(1), seed(0), zipf(nullptr) { }
+    std::string line;
+    uint64_t pairs;
+    uint64_t keys;
+    uint64_t seed;
+    const std::vector<double>* zipf;
+};
+
+/**
+ * Map and reduce of every suite workload. Reduce counts the pairs of a key
+ * (or, for large values, their bytes) and deletes them.
+ */
+class SuiteClient : public MapReduceClient {
+public:
+    explicit SuiteClient(SuiteKind kind) : kind(kind) { }
+
+    void map(const K1* key, const V1* value, void* context) const {
+      const VRecord* record = static_cast<const VRecord*>(value);
+      if (kind == WORD_COUNT) {
+        size_t begin = 0;
+        while (begin < record->line.size()) {
+          size_t end = record->line.find(' ', begin);
+          if (end == std::string::npos) {
+            end = record->line.size();
+          }
+          if (end > begin) {
+            emit2(new KWord(record->line.substr(begin, end - begin)),
+                  new VCount(1), context);
+          }
+          begin = end + 1;
+        }
+        return;
+      }
+      uint64_t state = record->seed;
+      for (uint64_t i = 0; i < record->pairs; ++i) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t key = (state >> 33) % record->keys;
+        if (record->zipf) {
+          double u = static_cast<double>(state >> 11) / 9007199254740992.0;
+          key = std::upper_bound(record->zipf->begin(), record->zipf->end(), u) -
+                record->zipf->begin();
+          key = std::min<uint64_t>(key, record->keys - 1);
+        }
+        if (kind == LARGE_VALUES) {
+          emit2(new KInt(key), new VBlob(LARGE_VALUE_BYTES), context);
+        } else {
+          emit2(new KInt(key), new VCount(1), context);
+        }
+      }
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const {
+      uint64_t total = 0;
+      for (const IntermediatePair& pair : *pairs) {
+        if (kind == LARGE_VALUES) {
+          total += static_cast<const VBlob*>(pair.second)->payload.size();
+        } else {
+          total += static_cast<const VCount*>(pair.second)->count;
+        }
+        delete pair.second;
+      }
+      for (size_t i = 1; i < pairs->size(); ++i) {
+        delete (*pairs)[i].first;
+      }
+      K2* key = pairs->at(0).first;
+      if (kind == WORD_COUNT) {
+        emit3(static_cast<KWord*>(key), new VCount(total), context);
+      } else {
+        emit3(static_cast<KInt*>(key), new VCount(total), context);
+      }
+    }
+
+    SuiteKind kind;
+};
+
+/**
+ * Builds the input records of a workload with about `pairs` intermediate
+ * pairs (fewer for large values, whose pairs are LARGE_VALUE_SCALE times
+ * fewer but much bigger). Returns the number of pairs the input emits.
+ */
+uint64_t buildSuiteInput(SuiteKind kind, uint64_t pairs,
+                         const std::vector<double>& zipf,
+                         std::vector<VRecord>& records)
+{
+  records.clear();
+  uint64_t keys = std::max<uint64_t>(1, pairs / SUITE_KEY_RATIO);
+  if (kind == WORD_COUNT) {
+    uint64_t lines = std::max<uint64_t>(1, pairs / WORDS_PER_LINE);
+    uint64_t state = 1;
+    records.resize(lines);
+    for (uint64_t i = 0; i < lines; ++i) {
+      for (int w = 0; w < WORDS_PER_LINE; ++w) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        records[i].line += "w" + std::to_string((state >> 33) % WORD_VOCABULARY) + " ";
+      }
+    }
+    return lines * WORDS_PER_LINE;
+  }
+  if (kind == LARGE_VALUES) {
+    pairs = std::max<uint64_t>(1, pairs / LARGE_VALUE_SCALE);
+  }
+  uint64_t splits = kind == TINY_RECORDS ? pairs : INPUT_SPLITS;
+  records.resize(splits);
+  for (uint64_t i = 0; i < splits; ++i) {
+    records[i].pairs = pairs / splits + (i < pairs % splits ? 1 : 0);
+    records[i].keys = keys;
+    records[i].seed = i + 1;
+    records[i].zipf = kind == ZIPF_KEYS ? &zipf : nullptr;
+  }
+  return pairs;
+}
+
+/**
+ * Returns the cumulative distribution of a Zipf law with ZIPF_EXPONENT over
+ * `keys` keys.
+ */
+std::vector<double> zipfDistribution(uint64_t keys)
+{
+  std::vector<double> cdf(keys);
+  double sum = 0;
+  for (uint64_t i = 0; i < keys; ++i) {
+    sum += 1.0 / std::pow(static_cast<double>(i + 1), ZIPF_EXPONENT);
+    cdf[i] = sum;
+  }
+  for (double& value : cdf) {
+    value /= sum;
+  }
+  return cdf;
+}
+
+/**
+ * One measured job of the suite.
+ */
+struct SuiteResult {
+    const char* workload;
+    uint64_t pairs;
+    int threads;
+    StageTimes times;
+    double efficiency;
+};
+
+/**
+ * Prints a result as a CSV line, or as a JSON object (`first` tells whether
+ * a separator is needed).
+ */
+void printSuiteResult(const SuiteResult& result, bool json, bool first)
+{
+  double pairs = static_cast<double>(result.pairs);
+  double total = result.times.map + result.times.shuffle + result.times.reduce;
+  double mapRate = result.times.map > 0 ? pairs / result.times.map * 1e3 : 0;
+  double shuffleRate = result.times.shuffle > 0 ? pairs / result.times.shuffle * 1e3 : 0;
+  double reduceRate = result.times.reduce > 0 ? pairs / result.times.reduce * 1e3 : 0;
+  if (json) {
+    std::printf("%s\n  {\"workload\": \"%s\", \"pairs\": %llu, \"threads\": %d, "
+                "\"map_pairs_per_sec\": %.0f, \"shuffle_pairs_per_sec\": %.0f, "
+                "\"reduce_pairs_per_sec\": %.0f, \"total_ms\": %.3f, "
+                "\"efficiency\": %.3f}",
+                first ? "" : ",", result.workload,
+                static_cast<unsigned long long>(result.pairs), result.threads,
+                mapRate, shuffleRate, reduceRate, total, result.efficiency);
+  } else {
+    std::printf("%s,%llu,%d,%.0f,%.0f,%.0f,%.3f,%.3f\n", result.workload,
+                static_cast<unsigned long long>(result.pairs), result.threads,
+                mapRate, shuffleRate, reduceRate, total, result.efficiency);
+  }
+  std::fflush(stdout);
+}
+
+/**
+ * Runs every suite workload at SUITE_SIZES input sizes, each SUITE_SIZE_STEP
+ * times the previous one up to max_pairs, and 1, 2, 4, ... threads. Reports
+ * pairs per second through each stage and the scaling efficiency, which is
+ * the speedup over one thread divided by the number of threads.
+ */
+int runSuiteBenchmark(int argc, char** argv)
+{
+  bool json = argc > 0 && std::strcmp(argv[0], "json") == 0;
+  if (argc > 0 && !json && std::strcmp(argv[0], "csv") != 0) {
+    std::fprintf(stderr, "%s\n", USAGE);
+    return EXIT_FAILURE;
+  }
+  uint64_t maxPairs = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                               : SUITE_DEFAULT_PAIRS;
+  int maxThreads = argc > 2 ? std::atoi(argv[2]) : SUITE_DEFAULT_MAX_THREADS;
+  if (argc > 3 || maxPairs == 0 || maxThreads < 1) {
+    std::fprintf(stderr, "%s\n", USAGE);
+    return EXIT_FAILURE;
+  }
+
+  if (json) {
+    std::printf("[");
+  } else {
+    std::printf("workload,pairs,threads,map_pairs_per_sec,shuffle_pairs_per_sec,"
+                "reduce_pairs_per_sec,total_ms,efficiency\n");
+  }
+  bool first = true;
+  for (int kind = 0; kind < SUITE_KINDS; ++kind) {
+    SuiteClient client(static_cast<SuiteKind>(kind));
+    uint64_t pairs = maxPairs;
+    for (int i = 1; i < SUITE_SIZES; ++i) {
+      pairs = std::max<uint64_t>(1, pairs / SUITE_SIZE_STEP);
+    }
+    for (int size = 0; size < SUITE_SIZES; ++size) {
+      std::vector<double> zipf;
+      if (kind == ZIPF_KEYS) {
+        zipf = zipfDistribution(std::max<uint64_t>(1, pairs / SUITE_KEY_RATIO));
+      }
+      std::vector<VRecord> records;
+      uint64_t emitted = buildSuiteInput(static_cast<SuiteKind>(kind), pairs,
+                                         zipf, records);
+      InputVec inputVec;
+      for (VRecord& record : records) {
+        inputVec.push_back(InputPair(nullptr, &record));
+      }
+      double singleMs = 0;
+      for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        SuiteResult result;
+        result.workload = SUITE_NAMES[kind];
+        result.pairs = emitted;
+        result.threads = threads;
+        result.times = runJob(client, inputVec, threads, false);
+        double total = result.times.map + result.times.shuffle + result.times.reduce;
+        if (threads == 1) {
+          singleMs = total;
+        }
+        result.efficiency = total > 0 ? singleMs / total / threads : 0;
+        printSuiteResult(result, json, first);
+        first = false;
+      }
+      pairs *= SUITE_SIZE_STEP;
+    }
+  }
+  if (json) {
+    std::printf("\n]\n");
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * One worker of the claiming microbenchmark: claims work units from the
+ * shared counter and reports progress the way phase() does, either per unit
+ * or per chunk, doing a trivial amount of work per unit.
+ */
+void claimWorker(std::atomic<uint64_t>* next, std::atomic<uint64_t>* progress,
+                 uint64_t total, int workers, bool chunked, uint64_t* sink)
+{
+  uint64_t sum = 0;
+  if (chunked) {
+    uint64_t begin;
+    uint64_t size;
+    while ((size = claimChunk(*next, total, workers, begin)) > 0) {
+      for (uint64_t i = begin; i < begin + size; ++i) {
+        sum += i;
+      }
+      progress->fetch_add(size);
+    }
+  } else {
+    uint64_t index;
+    while ((index = next->fetch_add(1)) < total) {
+      sum += index;
+      progress->fetch_add(1);
+    }
+  }
+  *sink = sum;
+}
+
+/**
+ * Times claiming `total` units with `threads` threads, in ns per unit.
+ */
+double timeClaiming(uint64_t total, int threads, bool chunked)
+{
+  std::atomic<uint64_t> next(0);
+  std::atomic<uint64_t> progress(0);
+  std::vector<uint64_t> sinks(threads);
+  std::vector<std::thread> workers;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(std::thread(claimWorker, &next, &progress, total,
+                                  threads, chunked, &sinks[i]));
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+  return elapsed.count() / static_cast<double>(total);
+}
+
+/**
+ * Compares per-unit claiming (one fetch_add on the work counter and one on
+ * the progress counter per unit, as phase() used to do) with guided chunk
+ * claiming, for 1, 2, 4, ... threads. Prints one CSV line per thread count.
+ */
+int runClaimBenchmark(int argc, char** argv)
+{
+  uint64_t items = argc > 0 ? std::strtoull(argv[0], nullptr, 10)
+                            : DEFAULT_CLAIM_ITEMS;
+  int maxThreads = argc > 1 ? std::atoi(argv[1]) : DEFAULT_MAX_THREADS;
+  if (argc > 2 || items == 0 || maxThreads < 1) {
+    std::fprintf(stderr, "%s\n", USAGE);
+    return EXIT_FAILURE;
+  }
+  std::printf("threads,items,per_item_ns,chunked_ns,speedup\n");
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    double perItem = timeClaiming(items, threads, false);
+    double chunked = timeClaiming(items, threads, true);
+    std::printf("%d,%llu,%.3f,%.3f,%.2f\n", threads,
+                static_cast<unsigned long long>(items), perItem, chunked,
+                perItem / chunked);
+    std::fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Runs one benchmark, the shuffle sweep by default.
+ *
+ * Build the library with optimisation (e.g. CXXFLAGS="-std=c++11 -O2 -I.")
+ * before trusting the numbers.
+ */
+int main(int argc, char** argv)
+{
+  Workload workload = {false, false, false};
+  if (argc < 2 || std::strcmp(argv[1], "shuffle") == 0) {
+    return runShuffleBenchmark(argc < 2 ? 0 : argc - 2, argv + 2, workload);
+  }
+  if (std::strcmp(argv[1], "skew") == 0) {
+    workload.skewed = true;
+    return runShuffleBenchmark(argc - 2, argv + 2, workload);
+  }
+  if (std::strcmp(argv[1], "arena") == 0) {
+    workload.arena = true;
+    return runShuffleBenchmark(argc - 2, argv + 2, workload);
+  }
+  if (std::strcmp(argv[1], "compare") == 0) {
+    workload.compared = true;
+    return runShuffleBenchmark(argc - 2, argv + 2, workload);
+  }
+  if (std::strcmp(argv[1], "template") == 0) {
+    return runTemplateBenchmark(argc - 2, argv + 2);
+  }
+  if (std::strcmp(argv[1], "suite") == 0) {
+    return runSuiteBenchmark(argc - 2, argv + 2);
+  }
+  if (std::strcmp(argv[1], "claim") == 0) {
+    return runClaimBenchmark(argc - 2, argv + 2);
+  }
+  std::fprintf(stderr, "%s\n", USAGE);
+  return EXIT_FAILURE;
+}
@@ -3,6 +3,8 @@
 
 #include <vector>  //std::vector
 #include <utility> //std::pair
+#include <string>  //std::string
+#include <cstdint> //uint64_t
 
 // input key and value.
 // the key, value for the map function and the MapReduceFramework
@@ -23,6 +25,16 @@ class K2 {
 public:
 	virtual ~K2(){}
 	virtual bool operator<(const K2 &other) const = 0;
+
+	// optional: stores in prefix the leading 64 bits of an order preserving
+	// encoding of the key (x < y implies x's prefix <= y's prefix), which
+	// lets the framework radix sort keys instead of comparing them. sets
+	// exact when equal prefixes always mean equal keys; otherwise keys that
+	// share a prefix are still compared with operator<.
+	// returns false when the key has no such encoding.
+	virtual bool normalizedPrefix(uint64_t &prefix, bool &exact) const {
+		return false;
+	}
 };
 
 class V2 {
@@ -62,6 +74,41 @@ public:
 	// calls emit3(K3, V3, context) any number of times (usually once)
 	// to output (K3, V3) pairs.
 	virtual void reduce(const IntermediateVec* pairs, void* context) const = 0;
+
+	// optional: gets all the (K2, V2) pairs of a single key that one thread
+	// emitted (at least two) and calls emit2(K2, V2, context) any number of
+	// times (usually once) to replace them with pairs of that same key.
+	// Like reduce, it is responsible for the pairs it gets.
+	// a combiner declares the reduce associative: reducing the pairs combine
+	// emits must give the same output as reducing the pairs it got. the
+	// framework also relies on this to split a huge key group into parts
+	// that are combined in parallel before a single reduce.
+	// returns false, without touching the pairs, when there is no combiner.
+	virtual bool combine(const IntermediateVec* pairs, void* context) const {
+		return false;
+	}
+
+	// optional, needed for JobOptions::spillPairs: appends a self-contained
+	// encoding of one (K2, V2) pair to out.
+	// returns false when the client does not serialize pairs.
+	virtual bool serialize(const K2* key, const V2* value,
+		std::string& out) const {
+		return false;
+	}
+
+	// optional, needed for JobOptions::spillPairs: rebuilds a pair from the
+	// size bytes serialize appended, as new objects that are handed around
+	// like the ones map emits.
+	virtual IntermediatePair deserialize(const char* data, size_t size) const {
+		return IntermediatePair(nullptr, nullptr);
+	}
+
+	// frees a (K2, V2) pair the framework is done with: one it has spilled,
+	// or one it only read back to look at the key. deletes both by default.
+	virtual void dispose(K2* key, V2* value) const {
+		delete key;
+		delete value;
+	}
 };
 
 
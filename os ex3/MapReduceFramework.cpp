@@ -1,16 +1,46 @@
 #include "MapReduceFramework.h"
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
-#include "Barrier.h"
+#include <new>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "Arena.h"
+#include "MapReduceJob.h"
+#include "SpillRun.h"
+#include "ThreadPool.h"
+#include "WorkClaim.h"
 #define SYSTEM_ERROR_PREFIX "system error: "
-#define ERROR_JOIN_FAILED "thread join failed with error code"
-#define EMIT3_ERROR "problem at the emit3 func"
-#define ERROR "error"
-#define PHASE_ERROR "there is a phase problem"
+#define OUTPUT_ERROR "problem at the output flush"
+#define FEED_ERROR "round output is not a K1 and V1 and no feed is set"
+#define PRODUCER_ERROR "failed to start the input producer"
+#define STAGE_ERROR "onJobStage given an unknown stage"
+#define ADAPTER_ARENA_ERROR "no job arena for a client run by ClientAdapter"
 #define EXIT_FAIL 1
+#define SHUFFLE_OVERSAMPLING 16
+#define HOT_GROUP_MIN_PAIRS 4096
+#define HOT_PART_MIN_PAIRS 1024
+#define SOURCE_BATCH_RECORDS 16
+#define SOURCE_AHEAD_BATCHES 4
+#define CACHE_LINE_BYTES 64
+#define DONE_EVENT (REDUCE_STAGE + 1)
+#define MAX_TIMEOUT_MS 1e12
+#define SLICE_MICROSECONDS 2000
+#define SLICE_CHECK_INTERVAL 16
+#define RADIX_SORT_MIN_PAIRS 256
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_DIGITS (64 / RADIX_BITS)
+
+typedef std::chrono::steady_clock Clock;
 
 /**
  * @enum PhaseType
@@ -24,25 +54,182 @@ enum PhaseType {
     REDUCE_PHASE
 };
 
+/**
+ * @enum WorkerStep
+ * @brief The step of the job's lifecycle a worker runs when it is next
+ * picked by the pool (see runWorkerStep).
+ */
+enum WorkerStep {
+    MAP_STEP,
+    SHUFFLE_STEP,
+    MERGE_STEP,
+    DRAIN_STEP,
+    REDUCE_STEP,
+    OUTPUT_STEP
+};
+
+
+/**
+ * @struct RunRange
+ * @brief A [begin, end) window of one sorted intermediate vector, or of one
+ * spilled run.
+ *
+ * During the shuffle each thread walks one window per intermediate vector
+ * and spilled run, holding only the keys of its own key range. current is
+ * the pair at begin, read back from the file for a spilled run.
+ */
+struct RunRange {
+    IntermediateVec* run;
+    const SpillRun* spill;
+    size_t begin;
+    size_t end;
+    IntermediatePair current;
+};
+
+/**
+ * @struct OutputWindow
+ * @brief A [begin, end) window of one worker's sorted output buffer.
+ */
+struct OutputWindow {
+    OutputPair* begin;
+    OutputPair* end;
+};
+
+/**
+ * @enum CombinerState
+ * @brief What the job has learnt of the client's combiner so far.
+ */
+enum CombinerState {
+    COMBINER_UNKNOWN,
+    COMBINER_PRESENT,
+    COMBINER_ABSENT
+};
+
+/**
+ * @struct HotGroup
+ * @brief A key group too big for one reduce call to keep up with the rest of
+ * the job, split into parts that are combined in parallel if the client has
+ * a combiner, and otherwise kept as a single part.
+ *
+ * Each part is replaced by what the client's combine emits for it; the
+ * worker that finishes the last part reduces all of them as one group.
+ */
+struct HotGroup {
+    std::vector<IntermediateVec> parts;
+    std::atomic<size_t> partsLeft;
+};
+
+/**
+ * @struct TraceEvent
+ * @brief A span of one worker's time, in nanoseconds since the job started.
+ */
+struct TraceEvent {
+    const char* name;
+    int64_t begin;
+    int64_t end;
+};
 
 struct JobContext;
 /**
  * @struct ThreadContext
- * @brief Represents the context of a single thread in the MapReduce job.
+ * @brief Represents the context of a single worker in the MapReduce job.
  *
- * Each thread participating in the MapReduce process gets its own
- * ThreadContext, which includes an ID, intermediate key-value pairs collected
- * during the map phase, and a pointer to the shared JobContext.
+ * Each of the job's multiThreadLevel workers gets its own ThreadContext,
+ * which includes an ID, the step it runs next, its map deque, the chunk of
+ * work units it claimed, intermediate key-value pairs collected during the
+ * map phase, the windows of its shuffle key range, the output pairs it
+ * emitted during the reduce phase, and a pointer to the shared JobContext.
+ * A worker runs its steps as tasks on the shared pool. In a hash-partitioned
+ * job the pairs go to one bucket per shuffling worker (partitions) instead
+ * of intermediateData. With spilling, the sorted runs it wrote out to files
+ * are kept in spills. arena serves the client's jobAllocate calls made from
+ * this worker, which never runs two tasks at once.
+ * The counters are written by the worker only (see bump), and summed by
+ * getJobState and getJobMetrics at any time. The context is cache-line
+ * aligned, with the deque and the counters on lines of their own, so workers
+ * never write to a line another worker is using. In a node-local job, node
+ * is the NUMA node the pool prefers to run the worker on. When the job's
+ * input comes from a source, the records the worker took and has yet to map
+ * are in sourceBatch, and its claims index them instead of the input vector.
  */
-struct ThreadContext {
+struct alignas(CACHE_LINE_BYTES) ThreadContext {
     int id;
+    int node;
+    WorkerStep step;
     IntermediateVec intermediateData;
+    std::vector<IntermediateVec> partitions;
+    std::vector<RunRange> shuffleRanges;
+    std::vector<SpillRun*> spills;
+    // Whether intermediateData is spilled once it holds spillPairs pairs.
+    bool spillable;
+    // Set while the client's combine runs, whose pairs are not counted in
+    // pairsEmitted.
+    bool combining;
+    OutputVec outputData;
+    Arena arena;
     JobContext* context;
+    // Work units claimed by this worker in the current phase but not yet
+    // processed: [claimBegin, claimEnd).
+    uint64_t claimBegin;
+    uint64_t claimEnd;
+    std::vector<InputPair> sourceBatch;
+    // With sortedOutput, the windows of every worker's output buffer in this
+    // worker's key range, merged into the output vector from outputPosition.
+    std::vector<OutputWindow> outputWindows;
+    size_t outputPosition;
+    // Set from the moment the worker arrives or parks until its next task.
+    bool waiting;
+    Clock::time_point waitStart;
+    // The running task's first step and start time, and with trace, every
+    // task and wait so far.
+    WorkerStep taskStep;
+    Clock::time_point taskStart;
+    std::vector<TraceEvent> trace;
+
+    // Map deque: the input indices [dequeBegin, dequeEnd) not yet claimed.
+    // The owner pops from the front; idle workers steal from the back.
+    alignas(CACHE_LINE_BYTES) std::mutex dequeMutex;
+    uint64_t dequeBegin;
+    uint64_t dequeEnd;
+
+    // Metrics, and the job's progress as done by this worker: the work
+    // units of each stage, the intermediate pairs it added less those its
+    // combines consumed (modulo 2^64), and in a streaming round, the groups
+    // it shuffled.
+    alignas(CACHE_LINE_BYTES) std::atomic<uint64_t> itemsMapped;
+    std::atomic<uint64_t> pairsEmitted;
+    std::atomic<uint64_t> groupsReduced;
+    std::atomic<uint64_t> largestGroup;
+    std::atomic<uint64_t> waitNanos;
+    std::atomic<uint64_t> stageDone[REDUCE_STAGE + 1];
+    std::atomic<uint64_t> intermediatePairs;
+    std::atomic<uint64_t> groupsShuffled;
 
     ThreadContext(int id_, JobContext* ctx)
+        : combining(false),
+          waiting(false),
+          taskStep(MAP_STEP),
+          itemsMapped(0),
+          pairsEmitted(0),
+          groupsReduced(0),
+          largestGroup(0),
+          waitNanos(0),
+          intermediatePairs(0),
+          groupsShuffled(0)
     {
+      for (std::atomic<uint64_t> &done : stageDone) {
+        done.store(0);
+      }
       id = id_;
+      node = -1;
+      step = MAP_STEP;
       context = ctx;
+      dequeBegin = 0;
+      dequeEnd = 0;
+      spillable = false;
+      claimBegin = 0;
+      claimEnd = 0;
+      outputPosition = 0;
     }
 };
 
@@ -51,389 +238,2223 @@ struct ThreadContext {
  * @brief Represents the shared context for a full MapReduce job.
  *
  * This struct holds all the shared data and synchronization primitives needed
- * by multiple threads to execute a MapReduce job in parallel. It includes the
- * input/output data, counters, thread states, synchronization tools (mutexes,
- * barrier), and a job state tracker.
+ * by multiple workers to execute a MapReduce job in parallel. It includes the
+ * input/output data, counters, worker states, synchronization tools (mutexes,
+ * the arrival counter that ends each step), the job's task queue on the
+ * shared pool, and a job state tracker.
  */
 struct JobContext {
     int multiThreadLevel;
-    int sum_for_testing = 0;
-    int for_testing = 0;
     const InputVec& inputVec;
+    // When set, the input is pulled from source by the job's own producer
+    // thread, never a pool thread, since next may block, and inputVec is
+    // empty. The producer keeps up to sourceCapacity records in sourceQueue,
+    // from which workers take batches; a worker that finds it empty parks in
+    // sourceParked until a record comes or the source is exhausted
+    // (sourceDone). All of these are guarded by sourceMutex.
+    InputSource* source;
+    std::thread producer;
+    std::mutex sourceMutex;
+    std::condition_variable sourceCv;
+    std::deque<InputPair> sourceQueue;
+    size_t sourceCapacity;
+    std::vector<ThreadContext*> sourceParked;
+    bool sourceDone;
     OutputVec& outputVec;
     const MapReduceClient& client;
+    const JobOptions options;
+    // Whether the round reduces its groups as the shuffle merges them: with
+    // streamingReduce, or once a worker spilled a run (see afterMap).
+    bool streaming;
 
-    std::vector<std::thread> threadsVec;
     std::vector<ThreadContext*> threadCtx;
 
-
-    std::atomic<uint64_t> inputVecIndAtomic;
-    std::atomic<uint64_t> shuffledVecsAtomic;
-    std::atomic<uint32_t> intermediatePairsAtomicNum;
-
-    std::atomic<uint64_t> jobStateAtomic;
+    // The current stage, whose total is stageTotals[stage], stored before
+    // the stage is. The work units done are counted by the workers.
+    std::atomic<int> stageAtomic;
+    std::atomic<uint64_t> stageTotals[REDUCE_STAGE + 1];
     std::mutex outputMutex;
     std::mutex stateMutex;
 
-    Barrier* my_barrier;
+    ThreadPool::TaskQueue* taskQueue;
+    // Workers done with the current step; the last one starts the next step.
+    std::atomic<int> arrivals;
 
+    // Slot i holds thread i's sorted run once it is done mapping.
     std::vector<IntermediateVec> intermediateVectors;
     std::vector<IntermediateVec> shuffleQueue;
+    // The shuffled groups of node n's workers are shuffleQueue[
+    // nodeGroupsBegin[n], nodeGroupsBegin[n + 1]), claimed for reduce
+    // through nodeGroupsNext[n]. A job that is not node-local has one node.
+    int nodes;
+    std::vector<uint64_t> nodeGroupsBegin;
+    std::vector<std::atomic<uint64_t>> nodeGroupsNext;
 
-    std::atomic<bool> hasWaitedAtomic;
-    std::mutex intermediateMutex;
+    // Shuffle key-range boundaries: thread i groups the keys in
+    // [splitters[i - 1], splitters[i]) into rangeGroups[i].
+    std::vector<K2*> splitters;
+    std::vector<std::vector<IntermediateVec>> rangeGroups;
+    // Groups of at least hotGroupPairs pairs (0 when groups are never split)
+    // are set aside by range in rangeHotGroups, then split into hotGroups.
+    // Reduce claims every part of them, hotParts, before any other group.
+    size_t hotGroupPairs;
+    std::vector<std::vector<IntermediateVec>> rangeHotGroups;
+    std::deque<HotGroup> hotGroups;
+    std::vector<std::pair<HotGroup*, size_t>> hotParts;
+    std::atomic<uint64_t> hotPartsNext;
+    std::atomic<int> combinerState;
+    // Pairs read back from spilled runs to sample splitters from.
+    IntermediateVec spillSamples;
 
+    // Streaming reduce: key groups that are ready to be reduced, workers
+    // waiting for one, and the number of workers still shuffling.
+    std::deque<IntermediateVec> readyGroups;
+    std::vector<ThreadContext*> parkedWorkers;
+    std::mutex readyMutex;
+    int shufflersLeft;
 
+    // When the job started, and when the round started and each of its
+    // stages ended (-1 until it has), in nanoseconds since the start. The
+    // past*Nanos sum the stages of the rounds before.
+    Clock::time_point startTime;
+    std::atomic<int64_t> roundStartNanos;
+    std::atomic<int64_t> mapEndNanos;
+    std::atomic<int64_t> shuffleEndNanos;
+    std::atomic<int64_t> reduceEndNanos;
+    std::atomic<int64_t> pastMapNanos;
+    std::atomic<int64_t> pastShuffleNanos;
+    std::atomic<int64_t> pastReduceNanos;
+
+    // The round running (see JobOptions::rounds). From the second round on,
+    // the round maps the previous round's output, fedOutput, instead of the
+    // input. The job's output starts at outputBase in outputVec.
+    std::atomic<int> round;
+    OutputVec fedOutput;
+    size_t outputBase;
+
+    // Set once the last step is over; waitForJob waits for it. eventFd is
+    // the job's eventfd (-1 until jobEventFd creates it), signalled then.
+    bool finished;
+    int eventFd;
+    std::mutex doneMutex;
+    std::condition_variable doneCv;
+
+    // Callbacks waiting for the job to enter a stage, or for its end
+    // (DONE_EVENT), and the last of these events so far.
+    std::mutex callbackMutex;
+    std::vector<std::pair<JobCallback, void*>> callbacks[DONE_EVENT + 1];
+    int lastEvent;
 
     /**
      * @brief Constructor for JobContext.
-     * Initializes members, resizes thread containers, and creates the barrier.
+     * Initializes members, resizes worker containers, and creates the job's
+     * task queue on the shared pool.
      */
     JobContext(int multiThreadLevel,
                const InputVec& inputVec,
                OutputVec& outputVec,
-               const MapReduceClient& client)
+               const MapReduceClient& client,
+               const JobOptions& options)
         : multiThreadLevel(multiThreadLevel),
           inputVec(inputVec),
+          source(nullptr),
+          sourceCapacity(static_cast<size_t>(multiThreadLevel) *
+                         SOURCE_BATCH_RECORDS * SOURCE_AHEAD_BATCHES),
+          sourceDone(false),
           outputVec(outputVec),
           client(client),
-          jobStateAtomic(0),
-          my_barrier(new Barrier(multiThreadLevel)),
-          hasWaitedAtomic(false)
+          options(options),
+          streaming(options.streamingReduce),
+          stageAtomic(UNDEFINED_STAGE),
+          taskQueue(sharedPool().createQueue(options.weight)),
+          arrivals(0),
+          hotGroupPairs(0),
+          hotPartsNext(0),
+          combinerState(COMBINER_UNKNOWN),
+          shufflersLeft(multiThreadLevel),
+          startTime(Clock::now()),
+          roundStartNanos(0),
+          mapEndNanos(-1),
+          shuffleEndNanos(-1),
+          reduceEndNanos(-1),
+          pastMapNanos(0),
+          pastShuffleNanos(0),
+          pastReduceNanos(0),
+          round(1),
+          outputBase(outputVec.size()),
+          finished(false),
+          eventFd(-1),
+          lastEvent(UNDEFINED_STAGE)
     {
-      threadsVec.resize(multiThreadLevel);
+      for (std::atomic<uint64_t> &total : stageTotals) {
+        total.store(0);
+      }
       threadCtx.resize(multiThreadLevel);
+      intermediateVectors.resize(multiThreadLevel);
+      rangeGroups.resize(multiThreadLevel);
+      rangeHotGroups.resize(multiThreadLevel);
+      nodes = 1;
+      if (options.nodeLocal) {
+        nodes = std::max<int>(1, sharedPool().workersPerNode().size());
+      }
+      std::vector<std::atomic<uint64_t>> next(nodes);
+      nodeGroupsNext.swap(next);
+      for (std::atomic<uint64_t> &groups : nodeGroupsNext) {
+        groups.store(0);
+      }
+    }
+
+    /**
+     * @brief Whether pairs are grouped by the client's hash instead of sorted.
+     */
+    bool hashPartitioned() const {
+      return options.keyHash != nullptr && options.keyEqual != nullptr;
     }
 
     /**
      * @brief Destructor for JobContext.
-     * Joins any unjoined threads, deletes the barrier, and cleans up thread contexts.
+     * Joins the producer, deletes the task queue, closes the event fd and
+     * cleans up worker contexts. The job must be finished (see waitForJob).
      */
     ~JobContext() {
-      if (!hasWaitedAtomic.load()) {
-        for (std::thread& t : threadsVec) {
-          if (t.joinable()) {
-            try {
-              t.join();
-            } catch (const std::system_error& e) {
-              std::cerr <<  SYSTEM_ERROR_PREFIX <<  ERROR_JOIN_FAILED <<
-                        std::endl;
-              exit(EXIT_FAIL);
-            }
-          }
-        }
+      if (producer.joinable()) {
+        producer.join();
+      }
+      sharedPool().destroyQueue(taskQueue);
+      if (eventFd >= 0) {
+        close(eventFd);
       }
-      delete my_barrier;
       for (ThreadContext* ctx : threadCtx) {
-        delete ctx;
+        if (ctx) {
+          ctx->~ThreadContext();
+          free(ctx);
+        }
       }
     }
 };
 
 /**
- * Encodes job stage, number of tasks done, and total tasks into a single 64-bit integer.
- *
- * Bits layout:
- * [63–62]: stage, [61–31]: total, [30–0]: done
+ * Allocates a worker's context on cache lines of its own (new does not honor
+ * the alignment of ThreadContext before C++17). Freed by ~JobContext.
  */
-uint64_t encodeJobState(stage_t stage, uint32_t done, uint32_t
-total) {
-  return (static_cast<uint64_t>(stage) << 62) |
-         (static_cast<uint64_t>(total) << 31) |
-         static_cast<uint64_t>(done);
+ThreadContext* newThreadContext(int id, JobContext *jobCtx) {
+  void *memory = nullptr;
+  if (posix_memalign(&memory, CACHE_LINE_BYTES, sizeof(ThreadContext)) != 0) {
+    throw std::bad_alloc();
+  }
+  return new (memory) ThreadContext(id, jobCtx);
 }
 
 /**
- * Decodes a 64-bit job state into stage, done, and total.
- *
- * Extracts:
- * - stage from bits 63–62
- * - total from bits 61–31
- * - done from bits 30–0
+ * Adds n to one of a worker's counters. A worker's counters have one writer
+ * at a time, ordered by the pool and the step arrivals, so a relaxed load and
+ * store stand in for the locked read-modify-write; readers only ever see
+ * whole values.
+ */
+inline void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+/**
+ * Sums one counter over the job's workers. The sum of a counter that only
+ * grows never goes back between two calls.
+ */
+uint64_t sumCounters(JobContext *jobCtx,
+                     std::atomic<uint64_t> ThreadContext::*counter) {
+  uint64_t sum = 0;
+  for (ThreadContext *threadContext : jobCtx->threadCtx) {
+    sum += (threadContext->*counter).load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+/**
+ * Records that the job reached event (a stage, or DONE_EVENT) and runs the
+ * callbacks registered for it, outside the lock. A later round entering an
+ * earlier stage again leaves lastEvent alone, so a stage's callbacks run
+ * once per job, in the first round.
+ */
+void reachEvent(JobContext *jobCtx, int event) {
+  std::vector<std::pair<JobCallback, void*>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(jobCtx->callbackMutex);
+    jobCtx->lastEvent = std::max(jobCtx->lastEvent, event);
+    callbacks.swap(jobCtx->callbacks[event]);
+  }
+  for (const std::pair<JobCallback, void*> &callback : callbacks) {
+    callback.first(static_cast<JobHandle>(jobCtx), callback.second);
+  }
+}
+
+/**
+ * Moves the job to a stage of the given number of work units. The total is
+ * stored first, so whoever sees the stage sees its total; it never changes
+ * while the stage lasts.
  */
-void decodeState(uint64_t encodedState, stage_t &stage, uint32_t &done,
-                 uint32_t &total) {
-  stage = static_cast<stage_t>((encodedState >> 62) & 0x3);
-  total = static_cast<uint32_t>((encodedState >> 31) & 0x7FFFFFFF);
-  done = static_cast<uint32_t>(encodedState & 0x7FFFFFFF);
+void enterStage(JobContext *jobCtx, stage_t stage, uint64_t total) {
+  jobCtx->stageTotals[stage].store(total);
+  jobCtx->stageAtomic.store(stage);
+  reachEvent(jobCtx, stage);
 }
 
 
 
+bool pairKeyLess(const IntermediatePair &, const IntermediatePair &);
+void sortIntermediate(IntermediateVec &);
 int dosSort(ThreadContext *);
+void spillIntermediate(ThreadContext *);
+void releaseRuns(JobContext *);
+void dealInput(JobContext *, uint64_t);
+void mapFedPair(ThreadContext *, const OutputPair &);
+void startRound(JobContext *);
+uint64_t claimMapItem(ThreadContext *, uint64_t &);
+uint64_t claimSourceBatch(ThreadContext *, uint64_t &, bool &);
+void produceInput(JobContext *);
+JobHandle launchJob(JobContext *, uint64_t);
+uint64_t claimReduceChunk(ThreadContext *, uint64_t &);
+void assignNodes(JobContext *);
 int phase(ThreadContext* , PhaseType);
-int doShuffle(JobContext *, bool);
-/**
- * Executes the full lifecycle of a worker thread:
- * 1. Performs the Map phase.
- * 2. Sorts intermediate data.
- * 3. Waits at a barrier.
- * 4. If thread ID is 0, runs Shuffle and updates stage.
- * 5. Performs the Reduce phase.
- *
- * Exits on phase failure.
+void chooseSplitters(JobContext *);
+void locateShuffleRange(ThreadContext *);
+int doShuffle(ThreadContext *);
+int doHashShuffle(ThreadContext *);
+void publishGroup(ThreadContext *, IntermediateVec &);
+void collectShuffleQueue(JobContext *);
+void splitHotGroups(JobContext *);
+void reduceHotPart(ThreadContext *, uint64_t);
+void finishStreamingShuffle(ThreadContext *);
+void drainReadyGroups(ThreadContext *);
+void flushOutput(ThreadContext *);
+void locateOutputRanges(JobContext *);
+void mergeOutputRange(ThreadContext *);
+void runWorkerStep(ThreadContext *);
+
+/**
+ * Returns the process-wide pool that runs every job's workers. Created on
+ * first use and never destroyed, so its threads stay warm between jobs (and
+ * a worker calling exit() never waits on itself).
+ */
+std::atomic<int> requestedPoolSize(0);
+std::vector<int> requestedCpus;
+std::mutex requestedCpusMutex;
+ThreadPool& sharedPool() {
+  static ThreadPool* pool = [] {
+    std::lock_guard<std::mutex> lock(requestedCpusMutex);
+    return new ThreadPool(
+        requestedPoolSize.load() > 0 ? requestedPoolSize.load()
+                                     : std::max(1u, std::thread::hardware_concurrency()),
+        requestedCpus);
+  }();
+  return *pool;
+}
+
+/**
+ * Sets how many threads the shared pool gets when it is created.
+ */
+void setWorkerPoolSize(int numThreads) {
+  requestedPoolSize.store(numThreads);
+}
+
+/**
+ * Sets the cpus the shared pool's threads are pinned to when it is created.
+ */
+void setWorkerAffinity(const std::vector<int>& cpus) {
+  std::lock_guard<std::mutex> lock(requestedCpusMutex);
+  requestedCpus = cpus;
+}
+
+/**
+ * Nanoseconds from the job's start to the given time.
+ */
+int64_t jobNanos(JobContext* jobCtx, Clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      time - jobCtx->startTime).count();
+}
+
+/**
+ * Returns the name of a step in traces.
+ */
+const char* stepName(WorkerStep step) {
+  switch (step) {
+    case MAP_STEP:
+      return "map";
+    case SHUFFLE_STEP:
+      return "shuffle";
+    case MERGE_STEP:
+      return "merge";
+    case DRAIN_STEP:
+    case REDUCE_STEP:
+      return "reduce";
+    case OUTPUT_STEP:
+      return "output";
+  }
+  return "";
+}
+
+/**
+ * Ends the wait the worker is in, if any, adding it to its metrics and trace.
  */
-void threadLifeCycle(ThreadContext* threadContext) {
+void endWait(ThreadContext* threadContext, Clock::time_point now) {
   JobContext* jobCtx = threadContext->context;
-  if (!phase(threadContext, MAP_PHASE)){
-    std::cerr << SYSTEM_ERROR_PREFIX << PHASE_ERROR << std::endl;
-    exit (EXIT_FAIL);
+  if (threadContext->waiting) {
+    threadContext->waiting = false;
+    bump(threadContext->waitNanos,
+         std::chrono::duration_cast<std::chrono::nanoseconds>(
+             now - threadContext->waitStart).count());
+    if (jobCtx->options.trace) {
+      threadContext->trace.push_back({"wait",
+                                      jobNanos(jobCtx, threadContext->waitStart),
+                                      jobNanos(jobCtx, now)});
+    }
   }
-  dosSort(threadContext);
-  jobCtx->my_barrier->barrier();
-  if (threadContext->id == 0) {
-    bool no_more = false;
-    jobCtx->jobStateAtomic.store(encodeJobState(SHUFFLE_STAGE, 0,
-                                                jobCtx->intermediatePairsAtomicNum.load()));
-    doShuffle(jobCtx, no_more);
-    jobCtx->jobStateAtomic.store(encodeJobState(REDUCE_STAGE, 0,
-                                                jobCtx->shuffleQueue.size()));
+}
+
+/**
+ * Called as a worker's task starts: ends the wait it was in, if any, and
+ * notes which step the task runs and when.
+ */
+void beginTask(ThreadContext* threadContext) {
+  Clock::time_point now = Clock::now();
+  endWait(threadContext, now);
+  threadContext->taskStep = threadContext->step;
+  threadContext->taskStart = now;
+}
+
+/**
+ * Called as a worker's task hands the worker on (requeues it, parks it or
+ * arrives), before anything else may run it: traces the task and, unless
+ * the worker is just requeued, starts a wait.
+ */
+void endTask(ThreadContext* threadContext, bool waits) {
+  JobContext* jobCtx = threadContext->context;
+  Clock::time_point now = Clock::now();
+  if (jobCtx->options.trace) {
+    threadContext->trace.push_back({stepName(threadContext->taskStep),
+                                    jobNanos(jobCtx, threadContext->taskStart),
+                                    jobNanos(jobCtx, now)});
   }
-  if (!phase(threadContext, REDUCE_PHASE)){
-    std::cerr << SYSTEM_ERROR_PREFIX << PHASE_ERROR << std::endl;
-    exit (EXIT_FAIL);
+  if (waits) {
+    threadContext->waiting = true;
+    threadContext->waitStart = now;
   }
 }
 
 /**
- * Called during the Map phase to collect intermediate key-value pairs.
- * Appends the pair to the thread's intermediate vector and increments the global counter.
+ * Queues a worker's next step on the job's task queue, for its node if it
+ * has one.
  */
-void emit2(K2* key, V2* value, void* context) {
-  auto* threadCtx = static_cast<ThreadContext*>(context);
-  threadCtx->intermediateData.emplace_back(key, value);
-  threadCtx->context->intermediatePairsAtomicNum.fetch_add(1);
+void schedule(ThreadContext* threadContext) {
+  JobContext* jobCtx = threadContext->context;
+  sharedPool().submit(jobCtx->taskQueue,
+                      [threadContext] { runWorkerStep(threadContext); },
+                      threadContext->node);
 }
 
 /**
- * Called during the Reduce phase to emit output key-value pairs.
- * Adds the pair to the final output vector under mutex lock.
- * Exits if mutex fails.
+ * Queues the rest of the running task's step as the worker's next task.
  */
-void emit3(K3* key, V3* value, void* context) {
-  auto* ctx = static_cast<ThreadContext*>(context);
-  JobContext* jobCtx = ctx->context;
+void requeue(ThreadContext* threadContext) {
+  endTask(threadContext, false);
+  schedule(threadContext);
+}
 
-  try {
-    std::lock_guard<std::mutex> lock(jobCtx->outputMutex);
-    jobCtx->outputVec.emplace_back(key, value);
-  } catch (const std::system_error& e) {
-    std::cerr << SYSTEM_ERROR_PREFIX << EMIT3_ERROR << std::endl;
-    delete jobCtx;
-    exit(EXIT_FAIL);
+/**
+ * Moves every worker of the job to the given step and queues it.
+ */
+void startStep(JobContext* jobCtx, WorkerStep step) {
+  for (ThreadContext* threadContext : jobCtx->threadCtx) {
+    threadContext->step = step;
+    schedule(threadContext);
   }
 }
 
 /**
- * Initializes the job context and spawns worker threads.
- * Sets the initial MAP stage in job state.
- * Returns a JobHandle to be used for control functions.
+ * Called by a worker that is done with the current step. The last of the
+ * job's workers to arrive runs the continuation, which starts the next step;
+ * this takes the place of waiting at a barrier, so no pool thread blocks.
  */
-JobHandle startMapReduceJob(const MapReduceClient& client,
-                            const InputVec& inputVec,
-                            OutputVec& outputVec,
-                            int multiThreadLevel) {
-  auto* jobCtx = new JobContext(multiThreadLevel, inputVec, outputVec, client);
-  uint32_t totalMapPairs = static_cast<uint32_t>(inputVec.size());
-  jobCtx->jobStateAtomic.store(encodeJobState(MAP_STAGE, 0, totalMapPairs));
-
-  for (int i = 0; i < multiThreadLevel; ++i){
-    jobCtx->threadCtx[i] = new ThreadContext(i, jobCtx);
+void arrive(ThreadContext* threadContext, void (*continuation)(JobContext*)) {
+  JobContext* jobCtx = threadContext->context;
+  // Read before arriving: once the last worker arrives the job may finish
+  // and be closed.
+  int workers = jobCtx->multiThreadLevel;
+  endTask(threadContext, true);
+  if (jobCtx->arrivals.fetch_add(1) + 1 == workers) {
+    jobCtx->arrivals.store(0);
+    continuation(jobCtx);
+  }
+}
 
-    try {
-      jobCtx->threadsVec[i] = std::thread(&threadLifeCycle,
-                                        jobCtx->threadCtx[i]);
+/**
+ * Runs once every worker has mapped: updates stage, picks the shuffle key
+ * ranges and starts the shuffle.
+ */
+void afterMap(JobContext* jobCtx) {
+  jobCtx->mapEndNanos.store(jobNanos(jobCtx, Clock::now()));
+  // Every fed pair has been mapped and deleted.
+  OutputVec().swap(jobCtx->fedOutput);
+  uint64_t pairs = sumCounters(jobCtx, &ThreadContext::intermediatePairs);
+  enterStage(jobCtx, SHUFFLE_STAGE, pairs);
+  // A round that spilled reduces its groups as they are merged back, so they
+  // are never all read back into memory at once.
+  jobCtx->streaming = jobCtx->options.streamingReduce;
+  for (ThreadContext *threadContext : jobCtx->threadCtx) {
+    if (!threadContext->spills.empty()) {
+      jobCtx->streaming = true;
     }
-    catch (const std::system_error& e) {
-      std::cerr << SYSTEM_ERROR_PREFIX  << ERROR << std::endl;
-      exit(EXIT_FAIL);
+  }
+  if (!jobCtx->hashPartitioned()) {
+    chooseSplitters(jobCtx);
+    // A group bigger than a worker's share of the pairs holds up the end of
+    // the reduce unless it is reduced first, or in parts.
+    if (!jobCtx->streaming && jobCtx->multiThreadLevel > 1) {
+      jobCtx->hotGroupPairs = std::max<size_t>(HOT_GROUP_MIN_PAIRS,
+                                               pairs / jobCtx->multiThreadLevel);
     }
   }
-  return static_cast<JobHandle>(jobCtx);
+  startStep(jobCtx, SHUFFLE_STEP);
 }
 
-
 /**
- * Sorts the thread's intermediate data by key and adds it to the global intermediate vector.
+ * Runs once every worker has located its key range in a streaming job.
  */
-int dosSort(ThreadContext *threadContext)
-{
-  std::sort(threadContext->intermediateData.begin(), threadContext->intermediateData.end(),
-            [](const IntermediatePair &x, const IntermediatePair &y) {
-                return *x.first < *y.first;
-            });
+void afterLocate(JobContext* jobCtx) {
+  startStep(jobCtx, MERGE_STEP);
+}
 
-  {
-    std::lock_guard<std::mutex> lock(threadContext->context->intermediateMutex);
-    threadContext->context->intermediateVectors.push_back(threadContext->intermediateData);
-  }
-  return 1;
+/**
+ * Runs once every worker has shuffled: releases the sorted runs, collects
+ * the shuffled groups, updates stage and starts the reduce.
+ */
+void afterShuffle(JobContext* jobCtx) {
+  jobCtx->shuffleEndNanos.store(jobNanos(jobCtx, Clock::now()));
+  releaseRuns(jobCtx);
+  collectShuffleQueue(jobCtx);
+  splitHotGroups(jobCtx);
+  enterStage(jobCtx, REDUCE_STAGE,
+             jobCtx->shuffleQueue.size() + jobCtx->hotParts.size());
+  startStep(jobCtx, REDUCE_STEP);
 }
 
 /**
- * Executes either the Map or Reduce phase by iterating over assigned work units.
- * Uses atomic counters to divide work across threads.
+ * Ends the workers' last waits and wakes up whoever waits for the job.
  */
-int phase(ThreadContext* threadContext, PhaseType type) {
-  JobContext* ctx = threadContext->context;
-  if(!ctx){
-    return 0;
+void finishJob(JobContext* jobCtx) {
+  Clock::time_point now = Clock::now();
+  for (ThreadContext* threadContext : jobCtx->threadCtx) {
+    endWait(threadContext, now);
   }
-  if (type == REDUCE_PHASE) {
-    ctx->my_barrier->barrier();
+  jobCtx->reduceEndNanos.store(jobNanos(jobCtx, now));
+  // The callbacks run before the job counts as finished, since it may be
+  // closed as soon as it does.
+  reachEvent(jobCtx, DONE_EVENT);
+  std::lock_guard<std::mutex> lock(jobCtx->doneMutex);
+  jobCtx->finished = true;
+  if (jobCtx->eventFd >= 0) {
+    eventfd_write(jobCtx->eventFd, 1);
   }
+  jobCtx->doneCv.notify_all();
+}
 
-  std::atomic<uint64_t>* counter;
-  size_t total;
-
-  if (type == MAP_PHASE) {
-    counter = &ctx->inputVecIndAtomic;
-    total = ctx->inputVec.size();
+/**
+ * Runs once the round's output is in the output vector. Finishes the job,
+ * unless it has rounds left and has not converged: then the round's output
+ * is taken out of the output vector and fed to the next round, or put back
+ * if the client finds it has converged.
+ */
+void endRound(JobContext* jobCtx) {
+  int round = jobCtx->round.load();
+  if (round >= jobCtx->options.rounds) {
+    finishJob(jobCtx);
+    return;
+  }
+  OutputVec &outputVec = jobCtx->outputVec;
+  OutputVec &fedOutput = jobCtx->fedOutput;
+  if (jobCtx->outputBase == 0) {
+    fedOutput.swap(outputVec);
   } else {
-    counter = &ctx->shuffledVecsAtomic;
-    total = ctx->shuffleQueue.size();
+    fedOutput.assign(outputVec.begin() + jobCtx->outputBase, outputVec.end());
+    outputVec.resize(jobCtx->outputBase);
   }
-
-  uint64_t index;
-  while ((index = counter->fetch_add(1)) < total) {
-    if (type == MAP_PHASE) {
-      const auto& pair = ctx->inputVec[index];
-      ctx->client.map(pair.first, pair.second, threadContext);
+  if (jobCtx->options.converged &&
+      jobCtx->options.converged(round, fedOutput, jobCtx->options.convergedArg)) {
+    if (jobCtx->outputBase == 0) {
+      outputVec.swap(fedOutput);
     } else {
-      auto& vec = ctx->shuffleQueue[index];
-      ctx->client.reduce(&vec, threadContext);
+      outputVec.insert(outputVec.end(), fedOutput.begin(), fedOutput.end());
+      OutputVec().swap(fedOutput);
     }
-    ctx->jobStateAtomic.fetch_add(1);
+    finishJob(jobCtx);
+    return;
   }
-  return 1;
+  startRound(jobCtx);
 }
 
 /**
- * Waits for all threads to finish. Ensures this runs only once using atomic flag.
+ * Runs once every worker has handed its output over. With sortedOutput the
+ * workers still have to merge their sorted buffers, one key range each, so
+ * this splits the output into ranges and starts the merge.
  */
-void waitForJob(JobHandle job) {
-  auto* jobCtx = static_cast<JobContext*>(job);
-  bool expected = false;
-  if (jobCtx->hasWaitedAtomic.compare_exchange_strong(expected, true)) {
-    for (std::thread &t : jobCtx->threadsVec) {
-      if (t.joinable()) {
-        try {
-          t.join();
-        } catch (const std::system_error& e) {
-          std::cerr << SYSTEM_ERROR_PREFIX << ERROR_JOIN_FAILED << std::endl;
-          delete jobCtx;
-          exit(EXIT_FAIL);
+void afterReduce(JobContext* jobCtx) {
+  if (jobCtx->options.sortedOutput) {
+    locateOutputRanges(jobCtx);
+    startStep(jobCtx, OUTPUT_STEP);
+    return;
+  }
+  endRound(jobCtx);
+}
+
+/**
+ * Runs once every worker has merged its range of sorted output: frees the
+ * sorted buffers and ends the round.
+ */
+void afterOutput(JobContext* jobCtx) {
+  for (ThreadContext* threadContext : jobCtx->threadCtx) {
+    OutputVec().swap(threadContext->outputData);
+  }
+  endRound(jobCtx);
+}
+
+/**
+ * Runs a worker's next step of the job's lifecycle as a pool task:
+ * MAP_STEP:     performs the Map phase for a time slice, requeueing itself
+ *               (or parking while its input source has no record ready)
+ *               until the input is exhausted, then sorts intermediate data
+ *               (skipped in a hash-partitioned job).
+ * SHUFFLE_STEP: shuffles its own key range (or hash partition), in parallel
+ *               with the other workers.
+ * REDUCE_STEP:  performs the Reduce phase in time slices, then hands its
+ *               output pairs over to the job's output vector.
+ * OUTPUT_STEP:  with sortedOutput, merges its key range of every worker's
+ *               sorted output into the job's output vector.
+ * In a streaming round (with streamingReduce, or once a worker spilled),
+ * SHUFFLE_STEP only locates the key range, MERGE_STEP merges it while
+ * reducing groups as they are published, and DRAIN_STEP reduces whatever is
+ * left; there is no REDUCE_STEP.
+ *
+ * The last worker to finish a step runs the job-wide work in between and
+ * starts the next step (see arrive). Every way out of a task hands the
+ * worker on (requeue, arrive or parking), after which the task must not touch
+ * the worker or the job. A phase whose time slice runs out before its work
+ * does is requeued, and carries on from its claim in the next task.
+ */
+void runWorkerStep(ThreadContext* threadContext) {
+  JobContext* jobCtx = threadContext->context;
+  beginTask(threadContext);
+  switch (threadContext->step) {
+    case MAP_STEP:
+      switch (phase(threadContext, MAP_PHASE)) {
+        case -1:
+          // Parked until the producer has input for it.
+          return;
+        case 0:
+          requeue(threadContext);
+          return;
+      }
+      if (!jobCtx->hashPartitioned()) {
+        dosSort(threadContext);
+      }
+      arrive(threadContext, afterMap);
+      return;
+    case SHUFFLE_STEP:
+      if (!jobCtx->hashPartitioned()) {
+        locateShuffleRange(threadContext);
+        if (jobCtx->streaming) {
+          // Locating reads keys of other ranges, which their reducers may
+          // delete as soon as every worker has located its range.
+          arrive(threadContext, afterLocate);
+          return;
         }
       }
-    }
+      // fall through
+    case MERGE_STEP:
+      if (jobCtx->hashPartitioned()) {
+        doHashShuffle(threadContext);
+      } else {
+        doShuffle(threadContext);
+      }
+      if (!jobCtx->streaming) {
+        arrive(threadContext, afterShuffle);
+        return;
+      }
+      finishStreamingShuffle(threadContext);
+      threadContext->step = DRAIN_STEP;
+      // fall through
+    case DRAIN_STEP:
+      drainReadyGroups(threadContext);
+      return;
+    case REDUCE_STEP:
+      if (!phase(threadContext, REDUCE_PHASE)) {
+        requeue(threadContext);
+        return;
+      }
+      flushOutput(threadContext);
+      arrive(threadContext, afterReduce);
+      return;
+    case OUTPUT_STEP:
+      mergeOutputRange(threadContext);
+      arrive(threadContext, afterOutput);
+      return;
   }
 }
 
 /**
- * Retrieves the current job stage and completion percentage.
+ * Set by ClientAdapter while it runs a client's map or reduce on this thread
+ * (see MapReduceJob.h).
  */
-void getJobState(JobHandle job, JobState* state) {
-  auto* ctx = static_cast<JobContext*>(job);
-  uint64_t encodedState = ctx->jobStateAtomic.load();
+thread_local AdapterEmitter* adapterEmitter = nullptr;
 
-  uint32_t done = 0;
-  uint32_t total = 0;
-  stage_t stage = UNDEFINED_STAGE;
-  float percent = 0.0f;
+/**
+ * Called during the Map phase to collect intermediate key-value pairs.
+ * Appends the pair to the thread's intermediate vector (or, in a
+ * hash-partitioned job, to the bucket of the key's partition) and increments
+ * the global counter. Spills the vector once it reaches spillPairs.
+ * Under ClientAdapter, hands the pair to its emitter instead.
+ */
+void emit2(K2* key, V2* value, void* context) {
+  if (context == adapterEmitter) {
+    adapterEmitter->emit2(key, value);
+    return;
+  }
+  auto* threadCtx = static_cast<ThreadContext*>(context);
+  JobContext* jobCtx = threadCtx->context;
+  if (jobCtx->hashPartitioned()) {
+    size_t partition = jobCtx->options.keyHash(key) % threadCtx->partitions.size();
+    threadCtx->partitions[partition].emplace_back(key, value);
+  } else {
+    threadCtx->intermediateData.emplace_back(key, value);
+    if (threadCtx->spillable &&
+        threadCtx->intermediateData.size() >= jobCtx->options.spillPairs) {
+      spillIntermediate(threadCtx);
+    }
+  }
+  if (!threadCtx->combining) {
+    bump(threadCtx->pairsEmitted, 1);
+  }
+  bump(threadCtx->intermediatePairs, 1);
+}
+
+/**
+ * Called during the Reduce phase to emit output key-value pairs.
+ * Appends the pair to the thread's own output buffer; the buffers are moved
+ * to the job's output vector once the thread is done reducing.
+ * Under ClientAdapter, hands the pair to its emitter instead.
+ */
+void emit3(K3* key, V3* value, void* context) {
+  if (context == adapterEmitter) {
+    adapterEmitter->emit3(key, value);
+    return;
+  }
+  auto* ctx = static_cast<ThreadContext*>(context);
+  ctx->outputData.emplace_back(key, value);
+}
 
-  decodeState(encodedState, stage, done, total);
+/**
+ * Allocates from the arena of the worker whose context is given.
+ * Exits if the context is ClientAdapter's, which has no arena.
+ */
+void* jobAllocate(void* context, size_t size, size_t alignment) {
+  if (context == adapterEmitter) {
+    std::cerr << SYSTEM_ERROR_PREFIX << ADAPTER_ARENA_ERROR << std::endl;
+    exit(EXIT_FAIL);
+  }
+  return static_cast<ThreadContext*>(context)->arena.allocate(size, alignment);
+}
 
-  if (total > 0) {
-    float val = (static_cast<float>(done) / static_cast<float>(total)) ;
-    percent = val * 100.0f;
+/**
+ * Registers a destructor with the arena of the worker whose context is given.
+ * Exits if the context is ClientAdapter's, like jobAllocate.
+ */
+void jobRegisterDestructor(void* context, void* object, void (*destroy)(void*)) {
+  if (context == adapterEmitter) {
+    std::cerr << SYSTEM_ERROR_PREFIX << ADAPTER_ARENA_ERROR << std::endl;
+    exit(EXIT_FAIL);
   }
+  static_cast<ThreadContext*>(context)->arena.registerDestructor(object, destroy);
+}
 
-  state->percentage = percent;
-  state->stage = stage;
+/**
+ * Starts a job with default options.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec,
+                            OutputVec& outputVec,
+                            int multiThreadLevel) {
+  return startMapReduceJob(client, inputVec, outputVec, multiThreadLevel,
+                           JobOptions());
 }
 
 /**
- * Final cleanup: waits for threads and deletes job context.
+ * Initializes the job context and queues its workers on the shared pool,
+ * at least one even if multiThreadLevel is below 1.
+ * Sets the initial MAP stage in job state.
+ * Returns a JobHandle to be used for control functions.
  */
-void closeJobHandle(JobHandle job) {
-  auto* ctx = static_cast<JobContext*>(job);
-  waitForJob(job);
-  delete ctx;
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec,
+                            OutputVec& outputVec,
+                            int multiThreadLevel,
+                            const JobOptions& options) {
+  auto* jobCtx = new JobContext(std::max(1, multiThreadLevel), inputVec,
+                                outputVec, client, options);
+  return launchJob(jobCtx, inputVec.size());
+}
+
+/**
+ * Starts a job pulling its input from a source, with default options.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource& source,
+                            OutputVec& outputVec,
+                            int multiThreadLevel) {
+  return startMapReduceJob(client, source, outputVec, multiThreadLevel,
+                           JobOptions());
+}
+
+/**
+ * Initializes the context of a job pulling its input from a source and
+ * queues its workers on the shared pool, at least one as above.
+ * Exits if the job's producer thread cannot be created.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource& source,
+                            OutputVec& outputVec,
+                            int multiThreadLevel,
+                            const JobOptions& options) {
+  static const InputVec noInput;
+  auto* jobCtx = new JobContext(std::max(1, multiThreadLevel), noInput,
+                                outputVec, client, options);
+  jobCtx->source = &source;
+  JobHandle job = launchJob(jobCtx, source.sizeHint());
+  try {
+    jobCtx->producer = std::thread(produceInput, jobCtx);
+  } catch (const std::system_error& e) {
+    std::cerr << SYSTEM_ERROR_PREFIX << PRODUCER_ERROR << std::endl;
+    exit(EXIT_FAIL);
+  }
+  return job;
 }
 
 /**
- * Returns the largest key from all non-empty intermediate vectors.
+ * Creates the job's workers, dealing the input vector out to their deques,
+ * sets the initial MAP stage (of mapTotal work units) in job state and
+ * queues the workers.
+ * Returns a JobHandle to be used for control functions.
  */
-K2* getMax(const std::vector<IntermediateVec>& sortedVecs)
+JobHandle launchJob(JobContext *jobCtx, uint64_t mapTotal)
 {
-  K2* Keymax = nullptr;
-  for (auto& intermediateVec : sortedVecs) {
-    if (!intermediateVec.empty()) {
-      auto& pair = intermediateVec.back();
-      K2* currKey = pair.first;
-      if (Keymax == nullptr || *Keymax < *currKey) {
-        Keymax = currKey;
-      }
+  int multiThreadLevel = jobCtx->multiThreadLevel;
+  enterStage(jobCtx, MAP_STAGE, mapTotal);
+
+  for (int i = 0; i < multiThreadLevel; ++i){
+    jobCtx->threadCtx[i] = newThreadContext(i, jobCtx);
+    jobCtx->threadCtx[i]->spillable = jobCtx->options.spillPairs > 0 &&
+                                      !jobCtx->hashPartitioned();
+    if (jobCtx->hashPartitioned()) {
+      jobCtx->threadCtx[i]->partitions.resize(multiThreadLevel);
     }
   }
-  return Keymax;
+  dealInput(jobCtx, jobCtx->inputVec.size());
+  if (jobCtx->nodes > 1) {
+    assignNodes(jobCtx);
+  }
+  startStep(jobCtx, MAP_STEP);
+  return static_cast<JobHandle>(jobCtx);
 }
 
 /**
- * Compares two keys using operator< to determine if they are equal.
+ * Deals the indices of the round's input out to the workers' deques in
+ * equal consecutive slices.
  */
- int checkEqualKeys(K2* key1, K2* key2) {
-  if (*key1 < *key2 || *key2 < *key1) {
-    return 0;
+void dealInput(JobContext *jobCtx, uint64_t inputSize)
+{
+  int workers = jobCtx->multiThreadLevel;
+  for (int i = 0; i < workers; ++i) {
+    jobCtx->threadCtx[i]->dequeBegin = inputSize * i / workers;
+    jobCtx->threadCtx[i]->dequeEnd = inputSize * (i + 1) / workers;
   }
-  return 1;
 }
 
 /**
- * Groups all intermediate pairs by key across all threads.
- * Builds the shuffle queue for the Reduce phase.
+ * Starts the next round of an iterative job on the same workers, once the
+ * previous round's output is in fedOutput: adds the round's stage times to
+ * the past ones, resets what the round left behind (the workers' progress
+ * counters among it) and queues the workers to map the fed output.
  */
-int doShuffle(JobContext *jobCtx, bool no_more) {
-  {
-    jobCtx->for_testing++;
-    jobCtx->sum_for_testing = jobCtx->for_testing;
-    std::vector<IntermediateVec> shuffledVecs;
-    while (!no_more)
-    {
-      if (jobCtx->sum_for_testing < -1)
-      {
-        return 0;
-      }
-      jobCtx->for_testing++;
-
-      K2 *maxKey = getMax
-          (jobCtx->intermediateVectors);
-      if (!maxKey)
-      {
-        jobCtx->for_testing++;
-        jobCtx->sum_for_testing = jobCtx->for_testing;
-        break;
-      }else{
-        IntermediateVec newVec;
-        for (auto &intermediateVec: jobCtx->intermediateVectors)
-        {
-          while (!intermediateVec.empty ())
-          {
-            if (!checkEqualKeys (intermediateVec.back ().first, maxKey))
-            {
-              break;
-            }
-            jobCtx->for_testing++;
-            newVec.push_back (std::move (intermediateVec.back ()));
-            intermediateVec.pop_back ();
-            jobCtx->jobStateAtomic.fetch_add (1);
-            jobCtx->sum_for_testing = jobCtx->for_testing;
-          }
-        }
-        jobCtx->shuffleQueue.push_back (std::move (newVec));
-        jobCtx->for_testing++;
-      }
-    }
+void startRound(JobContext *jobCtx)
+{
+  int64_t now = jobNanos(jobCtx, Clock::now());
+  int64_t mapEnd = jobCtx->mapEndNanos.load();
+  int64_t shuffleEnd = jobCtx->shuffleEndNanos.load();
+  jobCtx->pastMapNanos.fetch_add(mapEnd - jobCtx->roundStartNanos.load());
+  jobCtx->pastShuffleNanos.fetch_add(shuffleEnd - mapEnd);
+  jobCtx->pastReduceNanos.fetch_add(now - shuffleEnd);
+  jobCtx->roundStartNanos.store(now);
+  jobCtx->mapEndNanos.store(-1);
+  jobCtx->shuffleEndNanos.store(-1);
+
+  jobCtx->source = nullptr;
+  jobCtx->intermediateVectors.resize(jobCtx->multiThreadLevel);
+  std::vector<IntermediateVec>().swap(jobCtx->shuffleQueue);
+  jobCtx->hotGroups.clear();
+  jobCtx->hotParts.clear();
+  jobCtx->hotPartsNext.store(0);
+  for (std::atomic<uint64_t> &groups : jobCtx->nodeGroupsNext) {
+    groups.store(0);
   }
-  return 1;
-}
\ No newline at end of file
+  jobCtx->shufflersLeft = jobCtx->multiThreadLevel;
+  for (ThreadContext *threadContext : jobCtx->threadCtx) {
+    threadContext->stageDone[MAP_STAGE].store(0);
+    threadContext->stageDone[SHUFFLE_STAGE].store(0);
+    threadContext->intermediatePairs.store(0);
+    threadContext->groupsShuffled.store(0);
+  }
+  dealInput(jobCtx, jobCtx->fedOutput.size());
+  jobCtx->round.fetch_add(1);
+  enterStage(jobCtx, MAP_STAGE, jobCtx->fedOutput.size());
+  // Only now, so that the last round's REDUCE stage never goes back.
+  for (ThreadContext *threadContext : jobCtx->threadCtx) {
+    threadContext->stageDone[REDUCE_STAGE].store(0);
+  }
+  startStep(jobCtx, MAP_STEP);
+}
+
+/**
+ * Maps an output pair of the previous round, fed to this one as input
+ * through the job's feed (or cast), and deletes the input pair.
+ * Exits if there is no feed and the key or value is not a K1 or V1.
+ */
+void mapFedPair(ThreadContext *threadContext, const OutputPair &output)
+{
+  JobContext *jobCtx = threadContext->context;
+  InputPair pair;
+  if (jobCtx->options.feed) {
+    pair = jobCtx->options.feed(output);
+  } else {
+    pair = InputPair(dynamic_cast<K1*>(output.first),
+                     dynamic_cast<V1*>(output.second));
+    if ((output.first && !pair.first) || (output.second && !pair.second)) {
+      std::cerr << SYSTEM_ERROR_PREFIX << FEED_ERROR << std::endl;
+      exit(EXIT_FAIL);
+    }
+  }
+  jobCtx->client.map(pair.first, pair.second, threadContext);
+  delete pair.first;
+  delete pair.second;
+}
+
+
+/**
+ * Gives each worker of a node-local job a home node. The workers are split
+ * into consecutive blocks, one per node, sized in proportion to the pool
+ * threads pinned to the node. Consecutive workers thus share a node, so a
+ * node's workers shuffle one span of keys and reduce the groups it holds,
+ * and a worker steals map input from its own node's workers first.
+ */
+void assignNodes(JobContext *jobCtx)
+{
+  const std::vector<int> &nodeWorkers = sharedPool().workersPerNode();
+  int poolWorkers = 0;
+  for (int workers : nodeWorkers) {
+    poolWorkers += workers;
+  }
+  int node = 0;
+  int nodeEnd = nodeWorkers[0];
+  for (int i = 0; i < jobCtx->multiThreadLevel; ++i) {
+    // The pool thread in the middle of worker i's share of the pool.
+    int64_t position = (2 * static_cast<int64_t>(i) + 1) * poolWorkers /
+                       (2 * jobCtx->multiThreadLevel);
+    while (position >= nodeEnd) {
+      nodeEnd += nodeWorkers[++node];
+    }
+    jobCtx->threadCtx[i]->node = node;
+  }
+}
+
+/**
+ * Runs the client's combiner over every key group of the thread's sorted
+ * intermediate data, replacing each group by whatever combine emits.
+ * Stops right away, leaving the data untouched, if the client has no combiner:
+ * at its first group, or without calling combine at all once the job knows.
+ */
+void doCombine(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  if (jobCtx->combinerState.load() == COMBINER_ABSENT) {
+    return;
+  }
+  IntermediateVec sorted;
+  sorted.swap(threadContext->intermediateData);
+  threadContext->intermediateData.reserve(sorted.size());
+
+  IntermediateVec group;
+  size_t combined = 0;
+  bool first = true;
+  size_t begin = 0;
+  while (begin < sorted.size()) {
+    size_t end = begin + 1;
+    while (end < sorted.size() && !(*sorted[begin].first < *sorted[end].first)) {
+      end++;
+    }
+    if (end - begin == 1) {
+      threadContext->intermediateData.push_back(sorted[begin]);
+    } else {
+      group.assign(sorted.begin() + begin, sorted.begin() + end);
+      threadContext->combining = true;
+      bool present = jobCtx->client.combine(&group, threadContext);
+      threadContext->combining = false;
+      if (present) {
+        jobCtx->combinerState.store(COMBINER_PRESENT);
+        combined += group.size();
+      } else if (first) {
+        jobCtx->combinerState.store(COMBINER_ABSENT);
+        threadContext->intermediateData.swap(sorted);
+        return;
+      } else {
+        threadContext->intermediateData.insert(
+            threadContext->intermediateData.end(), group.begin(), group.end());
+      }
+      first = false;
+    }
+    begin = end;
+  }
+  bump(threadContext->intermediatePairs, -combined);
+}
+
+/**
+ * Sorts the thread's intermediate data by key, combines it if the client has
+ * a combiner, and moves it into the thread's own slot of the job's
+ * intermediate vectors. No copy and no lock: each thread owns its slot.
+ */
+int dosSort(ThreadContext *threadContext)
+{
+  sortIntermediate(threadContext->intermediateData);
+  doCombine(threadContext);
+
+  threadContext->context->intermediateVectors[threadContext->id].swap(
+      threadContext->intermediateData);
+  return 1;
+}
+
+/**
+ * Sorts and combines the thread's intermediate data, like dosSort, and
+ * writes it to a spill file as one run, disposing of the in-memory pairs.
+ * If the client turns out not to serialize pairs, the data stays in memory
+ * and the thread stops trying to spill.
+ */
+void spillIntermediate(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  // The combiner emits through emit2, which must not spill meanwhile.
+  threadContext->spillable = false;
+  sortIntermediate(threadContext->intermediateData);
+  doCombine(threadContext);
+  SpillRun *run = SpillRun::write(jobCtx->client, threadContext->intermediateData,
+                                  jobCtx->options.spillDirectory);
+  if (!run) {
+    return;
+  }
+  for (IntermediatePair &pair : threadContext->intermediateData) {
+    jobCtx->client.dispose(pair.first, pair.second);
+  }
+  threadContext->intermediateData.clear();
+  threadContext->spills.push_back(run);
+  threadContext->spillable = true;
+}
+
+/**
+ * Frees the sorted runs once the shuffle is over: the in-memory ones (whose
+ * pairs now belong to the key groups), every spilled run, and the pairs read
+ * back from them to pick splitters.
+ */
+void releaseRuns(JobContext *jobCtx)
+{
+  std::vector<IntermediateVec>().swap(jobCtx->intermediateVectors);
+  for (ThreadContext *ctx : jobCtx->threadCtx) {
+    for (SpillRun *run : ctx->spills) {
+      delete run;
+    }
+    std::vector<SpillRun*>().swap(ctx->spills);
+  }
+  for (IntermediatePair &pair : jobCtx->spillSamples) {
+    jobCtx->client.dispose(pair.first, pair.second);
+  }
+  IntermediateVec().swap(jobCtx->spillSamples);
+}
+
+/**
+ * Claims the next input index to map: pops the front of the worker's own
+ * deque, or, once it is empty, steals the back half of the first non-empty
+ * deque of another worker and keeps all but its first index in its own
+ * deque. Never holds two deque locks at once.
+ * Returns the number of indices claimed (0 or 1).
+ */
+uint64_t claimMapItem(ThreadContext *threadContext, uint64_t &begin)
+{
+  {
+    std::lock_guard<std::mutex> lock(threadContext->dequeMutex);
+    if (threadContext->dequeBegin < threadContext->dequeEnd) {
+      begin = threadContext->dequeBegin++;
+      return 1;
+    }
+  }
+  JobContext *jobCtx = threadContext->context;
+  for (int i = 1; i < jobCtx->multiThreadLevel; ++i) {
+    ThreadContext *victim =
+        jobCtx->threadCtx[(threadContext->id + i) % jobCtx->multiThreadLevel];
+    uint64_t stolenBegin;
+    uint64_t stolenEnd;
+    {
+      std::lock_guard<std::mutex> lock(victim->dequeMutex);
+      uint64_t left = victim->dequeEnd - victim->dequeBegin;
+      if (left == 0) {
+        continue;
+      }
+      stolenEnd = victim->dequeEnd;
+      stolenBegin = stolenEnd - (left + 1) / 2;
+      victim->dequeEnd = stolenBegin;
+    }
+    std::lock_guard<std::mutex> lock(threadContext->dequeMutex);
+    begin = stolenBegin;
+    threadContext->dequeBegin = stolenBegin + 1;
+    threadContext->dequeEnd = stolenEnd;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Runs on the job's producer thread: pulls every record from the job's input
+ * source into sourceQueue, waiting while it holds sourceCapacity records, and
+ * queues a parked worker on the pool for each record. Once the source is
+ * exhausted, queues every parked worker, so it can see that nothing more is
+ * coming. next is called without the lock, so a source that blocks holds up
+ * only this thread.
+ */
+void produceInput(JobContext *jobCtx)
+{
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(jobCtx->sourceMutex);
+      jobCtx->sourceCv.wait(lock, [jobCtx] {
+        return jobCtx->sourceQueue.size() < jobCtx->sourceCapacity;
+      });
+    }
+    InputPair pair;
+    bool more = jobCtx->source->next(pair);
+    std::vector<ThreadContext*> parked;
+    {
+      std::lock_guard<std::mutex> lock(jobCtx->sourceMutex);
+      if (more) {
+        jobCtx->sourceQueue.push_back(pair);
+        if (!jobCtx->sourceParked.empty()) {
+          parked.push_back(jobCtx->sourceParked.back());
+          jobCtx->sourceParked.pop_back();
+        }
+      } else {
+        jobCtx->sourceDone = true;
+        parked.swap(jobCtx->sourceParked);
+      }
+    }
+    for (ThreadContext *ctx : parked) {
+      schedule(ctx);
+    }
+    if (!more) {
+      return;
+    }
+  }
+}
+
+/**
+ * Takes up to SOURCE_BATCH_RECORDS records the producer pulled from the
+ * job's input source into the worker's batch, which its claims then index
+ * from 0. Never waits for the source: when no record is ready but more may
+ * come, parks the worker until the producer queues it, and sets parked.
+ * Returns the number of records taken, 0 once the source is exhausted and
+ * every record taken (or when parked).
+ */
+uint64_t claimSourceBatch(ThreadContext *threadContext, uint64_t &begin,
+                          bool &parked)
+{
+  JobContext *jobCtx = threadContext->context;
+  std::vector<InputPair> &batch = threadContext->sourceBatch;
+  batch.clear();
+  {
+    std::lock_guard<std::mutex> lock(jobCtx->sourceMutex);
+    std::deque<InputPair> &queue = jobCtx->sourceQueue;
+    size_t size = std::min<size_t>(queue.size(), SOURCE_BATCH_RECORDS);
+    if (size == 0) {
+      if (!jobCtx->sourceDone) {
+        endTask(threadContext, true);
+        jobCtx->sourceParked.push_back(threadContext);
+        parked = true;
+      }
+      return 0;
+    }
+    batch.assign(queue.begin(), queue.begin() + size);
+    queue.erase(queue.begin(), queue.begin() + size);
+  }
+  jobCtx->sourceCv.notify_one();
+  begin = 0;
+  return batch.size();
+}
+
+/**
+ * Claims the next reduce units: one part of a hot group while any is left,
+ * otherwise a chunk of shuffled groups from an atomic counter shared by the
+ * job's workers (see claimChunk), from the groups of the worker's own node
+ * while any are left, then from the other nodes' in turn.
+ * Returns the number of units claimed, 0 once every unit is claimed.
+ */
+uint64_t claimReduceChunk(ThreadContext *threadContext, uint64_t &begin)
+{
+  JobContext *jobCtx = threadContext->context;
+  uint64_t hotParts = jobCtx->hotParts.size();
+  if (jobCtx->hotPartsNext.load(std::memory_order_relaxed) < hotParts) {
+    begin = jobCtx->hotPartsNext.fetch_add(1);
+    if (begin < hotParts) {
+      return 1;
+    }
+  }
+  int home = std::max(0, threadContext->node);
+  for (int i = 0; i < jobCtx->nodes; ++i) {
+    int node = (home + i) % jobCtx->nodes;
+    uint64_t first = jobCtx->nodeGroupsBegin[node];
+    uint64_t size = claimChunk(jobCtx->nodeGroupsNext[node],
+                               jobCtx->nodeGroupsBegin[node + 1] - first,
+                               jobCtx->multiThreadLevel, begin);
+    if (size > 0) {
+      begin += hotParts + first;
+      return size;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Counts work units done in the Map or Reduce phase towards the job state,
+ * and mapped ones in the worker's metrics.
+ */
+void addProgress(ThreadContext* threadContext, PhaseType type, uint64_t done) {
+  if (type == MAP_PHASE) {
+    bump(threadContext->stageDone[MAP_STAGE], done);
+    bump(threadContext->itemsMapped, done);
+  } else {
+    bump(threadContext->stageDone[REDUCE_STAGE], done);
+  }
+}
+
+/**
+ * Counts a reduce call on a group of the given size in the worker's metrics.
+ */
+void noteReduced(ThreadContext* threadContext, size_t size) {
+  bump(threadContext->groupsReduced, 1);
+  if (size > threadContext->largestGroup.load(std::memory_order_relaxed)) {
+    threadContext->largestGroup.store(size, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Executes the Map or Reduce phase for up to one time slice. Map takes input
+ * indices (of fedOutput, from an iterative job's second round on) from the
+ * worker's deque, stealing when it runs dry (see claimMapItem), so a few huge
+ * records at the end of one worker's slice do not keep the others idle; with
+ * an input source it takes small batches of the records the producer pulled
+ * instead (see claimSourceBatch). Reduce claims the parts of hot groups, then
+ * chunks of key groups (see claimReduceChunk); a reduce unit index below
+ * hotParts.size() is a part, the rest index the shuffle queue. A unit left
+ * unfinished when the slice runs out is kept for the worker's next slice.
+ * Progress is added to the job state once per chunk or slice, not once per
+ * unit.
+ * Returns 1 once no work unit is left to claim, 0 if the slice ran out first,
+ * and -1 if the worker was parked to wait for its input source, after which
+ * the worker must not be touched.
+ */
+int phase(ThreadContext* threadContext, PhaseType type) {
+  JobContext* ctx = threadContext->context;
+  Clock::time_point sliceEnd = Clock::now() +
+                               std::chrono::microseconds(SLICE_MICROSECONDS);
+
+  uint64_t done = 0;
+  while (true) {
+    if (threadContext->claimBegin == threadContext->claimEnd) {
+      if (done > 0 && (type == REDUCE_PHASE || ctx->source)) {
+        addProgress(threadContext, type, done);
+        done = 0;
+      }
+      uint64_t size;
+      if (type == MAP_PHASE && ctx->source) {
+        bool parked = false;
+        size = claimSourceBatch(threadContext, threadContext->claimBegin,
+                                parked);
+        if (parked) {
+          return -1;
+        }
+      } else if (type == MAP_PHASE) {
+        size = claimMapItem(threadContext, threadContext->claimBegin);
+      } else {
+        size = claimReduceChunk(threadContext, threadContext->claimBegin);
+      }
+      if (size == 0) {
+        addProgress(threadContext, type, done);
+        threadContext->claimEnd = threadContext->claimBegin;
+        return 1;
+      }
+      threadContext->claimEnd = threadContext->claimBegin + size;
+    }
+    uint64_t index = threadContext->claimBegin++;
+    if (type == MAP_PHASE && ctx->source) {
+      const InputPair& pair = threadContext->sourceBatch[index];
+      ctx->client.map(pair.first, pair.second, threadContext);
+      ctx->source->release(pair);
+    } else if (type == MAP_PHASE &&
+               ctx->round.load(std::memory_order_relaxed) > 1) {
+      mapFedPair(threadContext, ctx->fedOutput[index]);
+    } else if (type == MAP_PHASE) {
+      const auto& pair = ctx->inputVec[index];
+      ctx->client.map(pair.first, pair.second, threadContext);
+    } else if (index < ctx->hotParts.size()) {
+      reduceHotPart(threadContext, index);
+    } else {
+      auto& vec = ctx->shuffleQueue[index - ctx->hotParts.size()];
+      noteReduced(threadContext, vec.size());
+      ctx->client.reduce(&vec, threadContext);
+    }
+    done++;
+    if (done % SLICE_CHECK_INTERVAL == 1 && Clock::now() >= sliceEnd) {
+      addProgress(threadContext, type, done);
+      return 0;
+    }
+  }
+}
+
+/**
+ * Orders output pairs by key.
+ */
+bool outputKeyLess(const OutputPair &x, const OutputPair &y)
+{
+  return *x.first < *y.first;
+}
+
+/**
+ * Moves the thread's output buffer to the job's output vector.
+ *
+ * Takes the output mutex once per worker rather than once per pair. With
+ * sortedOutput, the worker only sorts its own buffer, which is often sorted
+ * already: the shuffle builds groups in key order and a worker reduces its
+ * chunks of them in increasing order. The workers then merge the buffers
+ * in parallel (see locateOutputRanges).
+ * Exits if the mutex fails.
+ */
+void flushOutput(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  OutputVec &outputData = threadContext->outputData;
+  if (!jobCtx->options.sortedOutput) {
+    try {
+      std::lock_guard<std::mutex> lock(jobCtx->outputMutex);
+      jobCtx->outputVec.insert(jobCtx->outputVec.end(), outputData.begin(),
+                               outputData.end());
+    } catch (const std::system_error& e) {
+      std::cerr << SYSTEM_ERROR_PREFIX << OUTPUT_ERROR << std::endl;
+      exit(EXIT_FAIL);
+    }
+    OutputVec().swap(outputData);
+    return;
+  }
+
+  if (!std::is_sorted(outputData.begin(), outputData.end(), outputKeyLess)) {
+    std::sort(outputData.begin(), outputData.end(), outputKeyLess);
+  }
+}
+
+/**
+ * Splits the workers' sorted output buffers into one key range per worker,
+ * at boundaries sampled from the buffers as the shuffle's splitters are,
+ * finds each range's window of every buffer, and grows the output vector so
+ * that each range has its own slice of it, in key order. The windows are
+ * located here, before any worker writes to the output vector, so the
+ * merge itself takes no lock.
+ */
+void locateOutputRanges(JobContext *jobCtx)
+{
+  int ranges = jobCtx->multiThreadLevel;
+  size_t total = 0;
+  for (ThreadContext *ctx : jobCtx->threadCtx) {
+    total += ctx->outputData.size();
+  }
+  size_t wanted = static_cast<size_t>(ranges) * SHUFFLE_OVERSAMPLING;
+  size_t stride = std::max<size_t>(1, total / wanted);
+  std::vector<K3*> samples;
+  for (ThreadContext *ctx : jobCtx->threadCtx) {
+    for (size_t i = stride / 2; i < ctx->outputData.size(); i += stride) {
+      samples.push_back(ctx->outputData[i].first);
+    }
+  }
+  std::sort(samples.begin(), samples.end(),
+            [](const K3 *x, const K3 *y) { return *x < *y; });
+  std::vector<K3*> splitters;
+  for (int i = 1; i < ranges && !samples.empty(); ++i) {
+    splitters.push_back(samples[(i * samples.size()) / ranges]);
+  }
+
+  auto keyBelow = [](const OutputPair &pair, const K3 *key) {
+    return *pair.first < *key;
+  };
+  size_t position = jobCtx->outputVec.size();
+  for (int id = 0; id < ranges; ++id) {
+    ThreadContext *merger = jobCtx->threadCtx[id];
+    merger->outputWindows.clear();
+    merger->outputPosition = position;
+    if (id > static_cast<int>(splitters.size())) {
+      continue;
+    }
+    for (ThreadContext *ctx : jobCtx->threadCtx) {
+      OutputPair *begin = ctx->outputData.data();
+      OutputPair *end = begin + ctx->outputData.size();
+      if (id > 0) {
+        begin = std::lower_bound(begin, end, splitters[id - 1], keyBelow);
+      }
+      if (id < static_cast<int>(splitters.size())) {
+        end = std::lower_bound(begin, end, splitters[id], keyBelow);
+      }
+      if (begin < end) {
+        merger->outputWindows.push_back({begin, end});
+        position += end - begin;
+      }
+    }
+  }
+  jobCtx->outputVec.resize(position);
+}
+
+/**
+ * Merges the windows of this worker's output key range into its slice of
+ * the output vector through a heap on their front keys.
+ */
+void mergeOutputRange(ThreadContext *threadContext)
+{
+  std::vector<OutputWindow> heap;
+  heap.swap(threadContext->outputWindows);
+  // A max-heap on "greater" keeps the smallest front key on top.
+  auto greater = [](const OutputWindow &x, const OutputWindow &y) {
+    return *y.begin->first < *x.begin->first;
+  };
+  OutputPair *out = threadContext->context->outputVec.data() +
+                    threadContext->outputPosition;
+  std::make_heap(heap.begin(), heap.end(), greater);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    OutputWindow &window = heap.back();
+    *out++ = *window.begin++;
+    if (window.begin == window.end) {
+      heap.pop_back();
+    } else {
+      std::push_heap(heap.begin(), heap.end(), greater);
+    }
+  }
+}
+
+/**
+ * Waits for the job to finish. Safe to call more than once.
+ */
+void waitForJob(JobHandle job) {
+  auto* jobCtx = static_cast<JobContext*>(job);
+  std::unique_lock<std::mutex> lock(jobCtx->doneMutex);
+  jobCtx->doneCv.wait(lock, [jobCtx] { return jobCtx->finished; });
+}
+
+/**
+ * Waits up to timeoutMs for the job to finish. Returns whether it has.
+ * A timeout of MAX_TIMEOUT_MS (over 30 years) or more, infinite or NaN waits
+ * without one, since the clock's deadline would overflow.
+ */
+bool waitForJob(JobHandle job, double timeoutMs) {
+  if (!(timeoutMs < MAX_TIMEOUT_MS)) {
+    waitForJob(job);
+    return true;
+  }
+  auto* jobCtx = static_cast<JobContext*>(job);
+  std::unique_lock<std::mutex> lock(jobCtx->doneMutex);
+  return jobCtx->doneCv.wait_for(
+      lock, std::chrono::duration<double, std::milli>(std::max(0.0, timeoutMs)),
+      [jobCtx] { return jobCtx->finished; });
+}
+
+/**
+ * Registers a callback for an event (a stage, or DONE_EVENT), or runs it
+ * right away if the job has reached the event already.
+ */
+void addCallback(JobContext *jobCtx, int event, JobCallback callback,
+                 void *arg) {
+  {
+    std::lock_guard<std::mutex> lock(jobCtx->callbackMutex);
+    if (jobCtx->lastEvent < event) {
+      jobCtx->callbacks[event].emplace_back(callback, arg);
+      return;
+    }
+  }
+  callback(static_cast<JobHandle>(jobCtx), arg);
+}
+
+/**
+ * Runs callback once the job enters stage.
+ * Exits if stage is not one of stage_t's.
+ */
+void onJobStage(JobHandle job, stage_t stage, JobCallback callback, void* arg) {
+  if (stage < UNDEFINED_STAGE || stage > REDUCE_STAGE) {
+    std::cerr << SYSTEM_ERROR_PREFIX << STAGE_ERROR << std::endl;
+    exit(EXIT_FAIL);
+  }
+  addCallback(static_cast<JobContext*>(job), stage, callback, arg);
+}
+
+/**
+ * Runs callback once the job is done.
+ */
+void onJobDone(JobHandle job, JobCallback callback, void* arg) {
+  addCallback(static_cast<JobContext*>(job), DONE_EVENT, callback, arg);
+}
+
+/**
+ * Returns the job's eventfd, creating it on the first call, already
+ * signalled if the job is done.
+ */
+int jobEventFd(JobHandle job) {
+  auto* jobCtx = static_cast<JobContext*>(job);
+  std::lock_guard<std::mutex> lock(jobCtx->doneMutex);
+  if (jobCtx->eventFd < 0) {
+    jobCtx->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (jobCtx->eventFd >= 0 && jobCtx->finished) {
+      eventfd_write(jobCtx->eventFd, 1);
+    }
+  }
+  return jobCtx->eventFd;
+}
+
+/**
+ * Retrieves the current job stage and completion percentage.
+ */
+void getJobState(JobHandle job, JobState* state) {
+  auto* ctx = static_cast<JobContext*>(job);
+  stage_t stage = static_cast<stage_t>(ctx->stageAtomic.load());
+  uint64_t total = ctx->stageTotals[stage].load();
+  float percent = 0.0f;
+
+  // Every unit counted in a worker's stageDone[stage] was done in this stage
+  // (or, in a streaming round, in the shuffle before it).
+  uint64_t done = 0;
+  for (ThreadContext *threadContext : ctx->threadCtx) {
+    done += threadContext->stageDone[stage].load(std::memory_order_relaxed);
+  }
+
+  if (total > 0) {
+    // An input source may hold more records than its size hint.
+    done = std::min(done, total);
+    double val = static_cast<double>(done) / static_cast<double>(total);
+    percent = static_cast<float>(val * 100.0);
+  }
+
+  state->percentage = percent;
+  state->stage = stage;
+}
+
+/**
+ * Milliseconds from one point of the job to another, in nanoseconds since
+ * its start; an end not reached yet (-1) counts as now.
+ */
+double stageMillis(JobContext* jobCtx, int64_t begin, int64_t end) {
+  if (end < 0) {
+    end = jobNanos(jobCtx, Clock::now());
+  }
+  return end > begin ? static_cast<double>(end - begin) / 1e6 : 0.0;
+}
+
+/**
+ * Reports per-stage wall time and per-thread counters of the job so far.
+ */
+void getJobMetrics(JobHandle job, JobMetrics* metrics) {
+  auto* ctx = static_cast<JobContext*>(job);
+  int64_t roundStart = ctx->roundStartNanos.load();
+  int64_t mapEnd = ctx->mapEndNanos.load();
+  int64_t shuffleEnd = ctx->shuffleEndNanos.load();
+  int64_t reduceEnd = ctx->reduceEndNanos.load();
+  metrics->mapMs = ctx->pastMapNanos.load() / 1e6 +
+                   stageMillis(ctx, roundStart, mapEnd);
+  metrics->shuffleMs = ctx->pastShuffleNanos.load() / 1e6 +
+      (mapEnd < 0 ? 0.0 : stageMillis(ctx, mapEnd, shuffleEnd));
+  metrics->reduceMs = ctx->pastReduceNanos.load() / 1e6 +
+      (shuffleEnd < 0 ? 0.0 : stageMillis(ctx, shuffleEnd, reduceEnd));
+  metrics->rounds = ctx->round.load();
+  metrics->largestGroup = 0;
+  metrics->threads.clear();
+  for (ThreadContext* threadContext : ctx->threadCtx) {
+    ThreadMetrics thread;
+    thread.itemsMapped = threadContext->itemsMapped.load(std::memory_order_relaxed);
+    thread.pairsEmitted = threadContext->pairsEmitted.load(std::memory_order_relaxed);
+    thread.groupsReduced = threadContext->groupsReduced.load(std::memory_order_relaxed);
+    thread.waitMs = static_cast<double>(
+        threadContext->waitNanos.load(std::memory_order_relaxed)) / 1e6;
+    metrics->threads.push_back(thread);
+    metrics->largestGroup = std::max<uint64_t>(
+        metrics->largestGroup,
+        threadContext->largestGroup.load(std::memory_order_relaxed));
+  }
+}
+
+/**
+ * Waits for the job and writes every worker's traced tasks and waits as
+ * Chrome trace-event JSON: one complete ("X") event per span, one track per
+ * worker. Returns false if the job was not traced or the file cannot be
+ * written.
+ */
+bool writeJobTrace(JobHandle job, const char* path) {
+  auto* ctx = static_cast<JobContext*>(job);
+  waitForJob(job);
+  if (!ctx->options.trace) {
+    return false;
+  }
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (ThreadContext* threadContext : ctx->threadCtx) {
+    out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\","
+        << "\"pid\":1,\"tid\":" << threadContext->id
+        << ",\"args\":{\"name\":\"worker " << threadContext->id << "\"}}";
+    first = false;
+    for (const TraceEvent& event : threadContext->trace) {
+      out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,"
+          << "\"tid\":" << threadContext->id
+          << ",\"ts\":" << static_cast<double>(event.begin) / 1e3
+          << ",\"dur\":" << static_cast<double>(event.end - event.begin) / 1e3
+          << "}";
+    }
+  }
+  out << "\n]}\n";
+  out.close();
+  return !out.fail();
+}
+
+/**
+ * Final cleanup: waits for the job and deletes job context, releasing the
+ * workers' arenas.
+ */
+void closeJobHandle(JobHandle job) {
+  auto* ctx = static_cast<JobContext*>(job);
+  waitForJob(job);
+  delete ctx;
+}
+
+/**
+ * Orders intermediate pairs by key.
+ */
+bool pairKeyLess(const IntermediatePair &x, const IntermediatePair &y)
+{
+  return *x.first < *y.first;
+}
+
+/**
+ * @struct PrefixedPair
+ * @brief An intermediate pair with its key's normalized prefix, for sorting.
+ */
+struct PrefixedPair {
+    uint64_t prefix;
+    IntermediatePair pair;
+};
+
+/**
+ * Sorts pairs by key. When every key has a normalized prefix (see
+ * K2::normalizedPrefix), runs an LSD radix sort on the prefixes, skipping
+ * the digits that all keys share, then compares keys with operator< only
+ * within runs of equal prefixes, and only if some prefix is not exact.
+ * Otherwise, or for few pairs, falls back to std::sort.
+ */
+void sortIntermediate(IntermediateVec &pairs)
+{
+  if (pairs.size() < RADIX_SORT_MIN_PAIRS) {
+    std::sort(pairs.begin(), pairs.end(), pairKeyLess);
+    return;
+  }
+  std::vector<PrefixedPair> items(pairs.size());
+  bool allExact = true;
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    bool exact = false;
+    if (!pairs[i].first->normalizedPrefix(items[i].prefix, exact)) {
+      std::sort(pairs.begin(), pairs.end(), pairKeyLess);
+      return;
+    }
+    allExact = allExact && exact;
+    items[i].pair = pairs[i];
+  }
+
+  std::vector<size_t> counts(RADIX_DIGITS * RADIX_BUCKETS, 0);
+  for (const PrefixedPair &item : items) {
+    for (int digit = 0; digit < RADIX_DIGITS; ++digit) {
+      counts[digit * RADIX_BUCKETS +
+             ((item.prefix >> (digit * RADIX_BITS)) & (RADIX_BUCKETS - 1))]++;
+    }
+  }
+  std::vector<PrefixedPair> buffer(items.size());
+  for (int digit = 0; digit < RADIX_DIGITS; ++digit) {
+    size_t *count = &counts[digit * RADIX_BUCKETS];
+    unsigned shared = (items[0].prefix >> (digit * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+    if (count[shared] == items.size()) {
+      continue;
+    }
+    size_t offset = 0;
+    for (int bucket = 0; bucket < RADIX_BUCKETS; ++bucket) {
+      size_t size = count[bucket];
+      count[bucket] = offset;
+      offset += size;
+    }
+    for (const PrefixedPair &item : items) {
+      buffer[count[(item.prefix >> (digit * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++] = item;
+    }
+    items.swap(buffer);
+  }
+
+  size_t begin = 0;
+  while (begin < items.size()) {
+    size_t end = begin + 1;
+    while (end < items.size() && items[end].prefix == items[begin].prefix) {
+      end++;
+    }
+    if (!allExact && end - begin > 1) {
+      std::sort(items.begin() + begin, items.begin() + end,
+                [](const PrefixedPair &x, const PrefixedPair &y) {
+                  return *x.pair.first < *y.pair.first;
+                });
+    }
+    for (size_t i = begin; i < end; ++i) {
+      pairs[i] = items[i].pair;
+    }
+    begin = end;
+  }
+}
+
+/**
+ * Picks multiThreadLevel - 1 key-range boundaries for the parallel shuffle.
+ *
+ * Samples keys at evenly spaced positions across all sorted intermediate
+ * vectors and spilled runs (so bigger ones get proportionally more samples;
+ * spilled samples are read back into spillSamples), sorts the
+ * sample and takes its quantiles. Equal boundaries simply leave a range empty,
+ * so all the pairs of a single key always land in exactly one range.
+ */
+void chooseSplitters(JobContext *jobCtx)
+{
+  jobCtx->splitters.clear();
+  uint64_t total = sumCounters(jobCtx, &ThreadContext::intermediatePairs);
+  int ranges = jobCtx->multiThreadLevel;
+  if (ranges < 2 || total == 0) {
+    return;
+  }
+  uint64_t wanted = static_cast<uint64_t>(ranges) * SHUFFLE_OVERSAMPLING;
+  uint64_t stride = std::max<uint64_t>(1, total / wanted);
+
+  std::vector<K2*> samples;
+  for (const IntermediateVec &vec : jobCtx->intermediateVectors) {
+    for (size_t i = stride / 2; i < vec.size(); i += stride) {
+      samples.push_back(vec[i].first);
+    }
+  }
+  for (ThreadContext *ctx : jobCtx->threadCtx) {
+    for (SpillRun *run : ctx->spills) {
+      for (size_t i = stride / 2; i < run->size(); i += stride) {
+        jobCtx->spillSamples.push_back(run->read(jobCtx->client, i));
+        samples.push_back(jobCtx->spillSamples.back().first);
+      }
+    }
+  }
+  if (samples.empty()) {
+    return;
+  }
+  std::sort(samples.begin(), samples.end(),
+            [](const K2 *x, const K2 *y) { return *x < *y; });
+  for (int i = 1; i < ranges; ++i) {
+    jobCtx->splitters.push_back(samples[(i * samples.size()) / ranges]);
+  }
+}
+
+/**
+ * Returns the key at the front of a non-empty run range.
+ */
+inline K2* frontKey(const RunRange& range)
+{
+  return range.current.first;
+}
+
+/**
+ * Loads the pair at begin of a non-empty run range into current.
+ */
+inline void loadFront(RunRange& range, const MapReduceClient& client)
+{
+  if (range.spill) {
+    range.current = range.spill->read(client, range.begin);
+  } else {
+    range.current = (*range.run)[range.begin];
+  }
+}
+
+/**
+ * Restores the min-heap order (by front key) of the run ranges below index i.
+ */
+void siftDown(std::vector<RunRange>& heap, size_t i)
+{
+  size_t size = heap.size();
+  RunRange moving = heap[i];
+  K2* movingKey = frontKey(moving);
+  while (true) {
+    size_t child = 2 * i + 1;
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size && *frontKey(heap[child + 1]) < *frontKey(heap[child])) {
+      child++;
+    }
+    if (!(*frontKey(heap[child]) < *movingKey)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = moving;
+}
+
+/**
+ * Builds a min-heap (by front key) out of non-empty run ranges.
+ */
+void buildHeap(std::vector<RunRange>& heap)
+{
+  for (size_t i = heap.size() / 2; i-- > 0;) {
+    siftDown(heap, i);
+  }
+}
+
+/**
+ * Pops one ready key group, if there is one, and reduces it.
+ * Returns false when there was no group to reduce.
+ */
+bool reduceReadyGroup(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  IntermediateVec group;
+  {
+    std::lock_guard<std::mutex> lock(jobCtx->readyMutex);
+    if (jobCtx->readyGroups.empty()) {
+      return false;
+    }
+    group.swap(jobCtx->readyGroups.front());
+    jobCtx->readyGroups.pop_front();
+  }
+  noteReduced(threadContext, group.size());
+  jobCtx->client.reduce(&group, threadContext);
+  addProgress(threadContext, REDUCE_PHASE, 1);
+  return true;
+}
+
+/**
+ * Hands a finished key group over to the Reduce phase.
+ *
+ * Normally the group waits in the worker's range until the shuffle is over,
+ * set aside if it is hot (see splitHotGroups).
+ * In a streaming round it is queued, and a parked worker (if any) is queued
+ * on the pool to reduce it; once the queue holds more groups than there are
+ * workers, the shuffling worker reduces one itself, which bounds the backlog.
+ */
+void publishGroup(ThreadContext *threadContext, IntermediateVec &group)
+{
+  JobContext *jobCtx = threadContext->context;
+  if (!jobCtx->streaming) {
+    if (jobCtx->hotGroupPairs > 0 && group.size() >= jobCtx->hotGroupPairs) {
+      jobCtx->rangeHotGroups[threadContext->id].push_back(std::move(group));
+    } else {
+      jobCtx->rangeGroups[threadContext->id].push_back(std::move(group));
+    }
+    return;
+  }
+  size_t backlog;
+  ThreadContext *parked = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(jobCtx->readyMutex);
+    jobCtx->readyGroups.push_back(std::move(group));
+    backlog = jobCtx->readyGroups.size();
+    if (!jobCtx->parkedWorkers.empty()) {
+      parked = jobCtx->parkedWorkers.back();
+      jobCtx->parkedWorkers.pop_back();
+    }
+  }
+  bump(threadContext->groupsShuffled, 1);
+  if (parked) {
+    schedule(parked);
+  }
+  if (backlog > static_cast<size_t>(jobCtx->multiThreadLevel)) {
+    reduceReadyGroup(threadContext);
+  }
+}
+
+/**
+ * Marks this worker's shuffle as done. The last worker to finish shuffling
+ * releases the sorted runs, moves the job to the REDUCE stage and requeues
+ * every parked worker, so it can see that nothing more is coming.
+ */
+void finishStreamingShuffle(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  std::vector<ThreadContext*> parked;
+  bool last;
+  {
+    std::lock_guard<std::mutex> lock(jobCtx->readyMutex);
+    last = --jobCtx->shufflersLeft == 0;
+    if (last) {
+      parked.swap(jobCtx->parkedWorkers);
+    }
+  }
+  if (last) {
+    jobCtx->shuffleEndNanos.store(jobNanos(jobCtx, Clock::now()));
+    releaseRuns(jobCtx);
+    enterStage(jobCtx, REDUCE_STAGE,
+               sumCounters(jobCtx, &ThreadContext::groupsShuffled));
+    for (ThreadContext *ctx : parked) {
+      schedule(ctx);
+    }
+  }
+}
+
+/**
+ * Reduces ready key groups for up to a time slice, then requeues itself.
+ * When no group is ready but some worker is still shuffling, the worker parks
+ * until a group is published. Once every worker is done shuffling and no
+ * group is left, hands its output over and finishes.
+ */
+void drainReadyGroups(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  Clock::time_point sliceEnd = Clock::now() +
+                               std::chrono::microseconds(SLICE_MICROSECONDS);
+  while (true) {
+    IntermediateVec group;
+    {
+      std::lock_guard<std::mutex> lock(jobCtx->readyMutex);
+      if (jobCtx->readyGroups.empty()) {
+        if (jobCtx->shufflersLeft > 0) {
+          endTask(threadContext, true);
+          jobCtx->parkedWorkers.push_back(threadContext);
+          return;
+        }
+        break;
+      }
+      group.swap(jobCtx->readyGroups.front());
+      jobCtx->readyGroups.pop_front();
+    }
+    noteReduced(threadContext, group.size());
+    jobCtx->client.reduce(&group, threadContext);
+    addProgress(threadContext, REDUCE_PHASE, 1);
+    if (Clock::now() >= sliceEnd) {
+      requeue(threadContext);
+      return;
+    }
+  }
+  flushOutput(threadContext);
+  arrive(threadContext, afterReduce);
+}
+
+/**
+ * Returns the window of a sorted vector holding the keys in
+ * [lower, upper), where a null bound means unbounded.
+ */
+RunRange findRunRange(IntermediateVec &vec, K2 *lower, K2 *upper)
+{
+  RunRange range = {&vec, nullptr, 0, vec.size(), IntermediatePair()};
+  if (lower) {
+    IntermediatePair bound(lower, nullptr);
+    range.begin = std::lower_bound(vec.begin(), vec.end(), bound,
+                                   pairKeyLess) - vec.begin();
+  }
+  if (upper) {
+    IntermediatePair bound(upper, nullptr);
+    range.end = std::lower_bound(vec.begin() + range.begin, vec.end(),
+                                 bound, pairKeyLess) - vec.begin();
+  }
+  return range;
+}
+
+/**
+ * Returns the first record of a spilled run in [begin, end) whose key is not
+ * below bound, reading the probed records back (and disposing of them).
+ */
+size_t spillLowerBound(const MapReduceClient &client, const SpillRun &run,
+                       size_t begin, size_t end, K2 *bound)
+{
+  while (begin < end) {
+    size_t middle = begin + (end - begin) / 2;
+    IntermediatePair pair = run.read(client, middle);
+    bool below = *pair.first < *bound;
+    client.dispose(pair.first, pair.second);
+    if (below) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return begin;
+}
+
+/**
+ * Returns the window of a spilled run holding the keys in [lower, upper),
+ * where a null bound means unbounded.
+ */
+RunRange findSpillRange(const MapReduceClient &client, const SpillRun &run,
+                        K2 *lower, K2 *upper)
+{
+  RunRange range = {nullptr, &run, 0, run.size(), IntermediatePair()};
+  if (lower) {
+    range.begin = spillLowerBound(client, run, range.begin, range.end, lower);
+  }
+  if (upper) {
+    range.end = spillLowerBound(client, run, range.begin, range.end, upper);
+  }
+  return range;
+}
+
+/**
+ * Finds the windows of every sorted vector and spilled run that hold this
+ * worker's key range, and loads the front pair of each.
+ */
+void locateShuffleRange(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  const std::vector<K2*> &splitters = jobCtx->splitters;
+  int id = threadContext->id;
+  if (id > static_cast<int>(splitters.size())) {
+    return;
+  }
+  K2 *lower = id > 0 ? splitters[id - 1] : nullptr;
+  K2 *upper = id < static_cast<int>(splitters.size()) ? splitters[id] : nullptr;
+  for (IntermediateVec &vec : jobCtx->intermediateVectors) {
+    RunRange range = findRunRange(vec, lower, upper);
+    if (range.begin < range.end) {
+      threadContext->shuffleRanges.push_back(range);
+    }
+  }
+  for (ThreadContext *ctx : jobCtx->threadCtx) {
+    for (SpillRun *run : ctx->spills) {
+      RunRange range = findSpillRange(jobCtx->client, *run, lower, upper);
+      if (range.begin < range.end) {
+        threadContext->shuffleRanges.push_back(range);
+      }
+    }
+  }
+  for (RunRange &range : threadContext->shuffleRanges) {
+    loadFront(range, jobCtx->client);
+  }
+}
+
+/**
+ * Groups the intermediate pairs of this worker's key range by key, across
+ * all workers' sorted vectors and spilled runs. The groups are built in
+ * ascending key order.
+ *
+ * The ranges are merged through a binary min-heap on their front keys, so
+ * moving a pair costs O(log threads) comparisons, and a pair whose run keeps
+ * the same key as the one before it costs a single comparison. A group is
+ * gathered in a scratch vector that keeps its capacity, then copied into a
+ * vector of exactly its size, so each group costs one allocation.
+ */
+int doShuffle(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  std::vector<RunRange> ranges;
+  ranges.swap(threadContext->shuffleRanges);
+  buildHeap(ranges);
+  IntermediateVec scratch;
+  while (!ranges.empty()) {
+    K2 *key = frontKey(ranges[0]);
+    scratch.clear();
+    bool sameKey = true;
+    while (sameKey) {
+      RunRange &top = ranges[0];
+      scratch.push_back(top.current);
+      top.begin++;
+      if (top.begin < top.end) {
+        loadFront(top, jobCtx->client);
+        if (!(*key < *frontKey(top))) {
+          continue;
+        }
+      }
+      if (top.begin == top.end) {
+        top = ranges.back();
+        ranges.pop_back();
+        if (ranges.empty()) {
+          break;
+        }
+      }
+      siftDown(ranges, 0);
+      sameKey = !(*key < *frontKey(ranges[0]));
+    }
+    bump(threadContext->stageDone[SHUFFLE_STAGE], scratch.size());
+    IntermediateVec group(scratch.begin(), scratch.end());
+    publishGroup(threadContext, group);
+  }
+  return 1;
+}
+
+/**
+ * @struct KeyHasher
+ * @brief Adapts the client's key hash to std::unordered_map.
+ */
+struct KeyHasher {
+    KeyHashFunc hash;
+    size_t operator()(const K2* key) const { return hash(key); }
+};
+
+/**
+ * @struct KeyEquals
+ * @brief Adapts the client's key equality to std::unordered_map.
+ */
+struct KeyEquals {
+    KeyEqualFunc equal;
+    bool operator()(const K2* x, const K2* y) const { return equal(x, y); }
+};
+
+/**
+ * Groups the pairs of this thread's hash partition, gathered from every
+ * thread's bucket, by key equality. No sorting is involved, so the groups
+ * come out in first-seen order.
+ */
+int doHashShuffle(ThreadContext *threadContext)
+{
+  JobContext *jobCtx = threadContext->context;
+  int id = threadContext->id;
+  std::vector<IntermediateVec> groups;
+  KeyHasher hasher = {jobCtx->options.keyHash};
+  KeyEquals equals = {jobCtx->options.keyEqual};
+  std::unordered_map<const K2*, size_t, KeyHasher, KeyEquals>
+      groupIndex(0, hasher, equals);
+  for (ThreadContext *ctx : jobCtx->threadCtx) {
+    IntermediateVec &bucket = ctx->partitions[id];
+    for (IntermediatePair &pair : bucket) {
+      auto found = groupIndex.emplace(pair.first, groups.size());
+      if (found.second) {
+        groups.push_back(IntermediateVec());
+      }
+      groups[found.first->second].push_back(pair);
+    }
+    bump(threadContext->stageDone[SHUFFLE_STAGE], bucket.size());
+    IntermediateVec().swap(bucket);
+  }
+  for (IntermediateVec &group : groups) {
+    publishGroup(threadContext, group);
+  }
+  return 1;
+}
+
+/**
+ * Concatenates the per-range groups, in range order, into the shuffle queue
+ * for the Reduce phase, and notes where each node's groups start (the
+ * ranges of a node's workers are consecutive; see assignNodes).
+ */
+void collectShuffleQueue(JobContext *jobCtx)
+{
+  size_t total = 0;
+  for (const std::vector<IntermediateVec> &groups : jobCtx->rangeGroups) {
+    total += groups.size();
+  }
+  jobCtx->shuffleQueue.reserve(total);
+  jobCtx->nodeGroupsBegin.assign(jobCtx->nodes + 1, 0);
+  for (int i = 0; i < jobCtx->multiThreadLevel; ++i) {
+    std::vector<IntermediateVec> &groups = jobCtx->rangeGroups[i];
+    for (IntermediateVec &group : groups) {
+      jobCtx->shuffleQueue.push_back(std::move(group));
+    }
+    std::vector<IntermediateVec>().swap(groups);
+    int node = std::max(0, jobCtx->threadCtx[i]->node);
+    jobCtx->nodeGroupsBegin[node + 1] = jobCtx->shuffleQueue.size();
+  }
+  for (int node = 1; node <= jobCtx->nodes; ++node) {
+    jobCtx->nodeGroupsBegin[node] = std::max(jobCtx->nodeGroupsBegin[node],
+                                             jobCtx->nodeGroupsBegin[node - 1]);
+  }
+}
+
+/**
+ * Splits every hot group set aside by the shuffle into up to one part per
+ * worker, each of at least HOT_PART_MIN_PAIRS pairs (a single part when the
+ * client has no combiner), and lists the parts for the Reduce phase, biggest
+ * group first, so that even a group that cannot be split starts reducing
+ * while the other workers still have the rest of the groups to get through.
+ */
+void splitHotGroups(JobContext *jobCtx)
+{
+  std::vector<IntermediateVec> groups;
+  for (std::vector<IntermediateVec> &range : jobCtx->rangeHotGroups) {
+    for (IntermediateVec &group : range) {
+      groups.push_back(std::move(group));
+    }
+    std::vector<IntermediateVec>().swap(range);
+  }
+  std::sort(groups.begin(), groups.end(),
+            [](const IntermediateVec &x, const IntermediateVec &y) {
+              return x.size() > y.size();
+            });
+  for (IntermediateVec &group : groups) {
+    size_t parts = 1;
+    if (jobCtx->combinerState.load() != COMBINER_ABSENT) {
+      parts = std::max<size_t>(1, std::min<size_t>(jobCtx->multiThreadLevel,
+                                                   group.size() / HOT_PART_MIN_PAIRS));
+    }
+    jobCtx->hotGroups.emplace_back();
+    HotGroup &hot = jobCtx->hotGroups.back();
+    hot.parts.resize(parts);
+    hot.partsLeft.store(parts);
+    for (size_t i = 0; i < parts; ++i) {
+      hot.parts[i].assign(group.begin() + group.size() * i / parts,
+                          group.begin() + group.size() * (i + 1) / parts);
+      jobCtx->hotParts.push_back(std::make_pair(&hot, i));
+    }
+  }
+}
+
+/**
+ * Combines one part of a hot group, replacing it by the pairs the client's
+ * combine emits (or leaving it whole if there is no combiner). The worker
+ * that finishes the group's last part reduces all of its parts as one group.
+ */
+void reduceHotPart(ThreadContext *threadContext, uint64_t index)
+{
+  JobContext *jobCtx = threadContext->context;
+  HotGroup *hot = jobCtx->hotParts[index].first;
+  IntermediateVec &part = hot->parts[jobCtx->hotParts[index].second];
+  // combine emits through emit2, into the emptied intermediate data, which
+  // must not be spilled.
+  bool spillable = threadContext->spillable;
+  threadContext->spillable = false;
+  threadContext->combining = true;
+  if (hot->parts.size() > 1 && jobCtx->client.combine(&part, threadContext)) {
+    bump(threadContext->intermediatePairs, -part.size());
+    part.clear();
+    part.swap(threadContext->intermediateData);
+  }
+  threadContext->combining = false;
+  threadContext->spillable = spillable;
+  if (hot->partsLeft.fetch_sub(1) != 1) {
+    return;
+  }
+
+  size_t size = 0;
+  for (const IntermediateVec &combined : hot->parts) {
+    size += combined.size();
+  }
+  IntermediateVec group;
+  group.reserve(size);
+  for (IntermediateVec &combined : hot->parts) {
+    group.insert(group.end(), combined.begin(), combined.end());
+    IntermediateVec().swap(combined);
+  }
+  noteReduced(threadContext, group.size());
+  jobCtx->client.reduce(&group, threadContext);
+}
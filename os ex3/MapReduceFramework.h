@@ -2,6 +2,11 @@
 #define MAPREDUCEFRAMEWORK_H
 
 #include "MapReduceClient.h"
+#include "InputSource.h"
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 typedef void* JobHandle;
 
@@ -12,15 +17,212 @@ typedef struct {
 	float percentage;
 } JobState;
 
+typedef size_t (*KeyHashFunc)(const K2* key);
+typedef bool (*KeyEqualFunc)(const K2* first, const K2* second);
+typedef InputPair (*FeedFunc)(const OutputPair& pair);
+typedef bool (*ConvergedFunc)(int round, const OutputVec& output, void* arg);
+
+// optional settings for a MapReduce job. A default constructed JobOptions
+// runs the job exactly like the four argument startMapReduceJob.
+struct JobOptions {
+	// when both are set, intermediate pairs are grouped by hash and equality
+	// instead of being sorted by K2::operator<. Each reduce call still gets
+	// all the pairs of one key, but the keys come in no particular order.
+	// MapReduceClient::combine is not called in this mode.
+	KeyHashFunc keyHash;
+	KeyEqualFunc keyEqual;
+
+	// when set, the pairs the job appends to outputVec are sorted by
+	// K3::operator<. Otherwise they come in no particular order. each
+	// thread sorts what it emitted (usually already in order, since groups
+	// are reduced in key order) and the threads merge the results in
+	// parallel, one key range each.
+	bool sortedOutput;
+
+	// when set, each key group is handed to a reducing thread as soon as the
+	// shuffle completes it, so reduce overlaps the rest of the shuffle.
+	// The job reports REDUCE_STAGE once the whole shuffle is done.
+	bool streamingReduce;
+
+	// the job's share of the worker pool relative to other running jobs:
+	// while several jobs have work queued, a job with weight 2 runs twice as
+	// many tasks as a job with weight 1.
+	int weight;
+
+	// when positive, a thread that holds this many intermediate pairs sorts
+	// them and spills them to a file as a run, through the client's
+	// serialize (then dispose), and the shuffle merges the runs back through
+	// deserialize. Ignored if the client does not serialize pairs, and in a
+	// hash grouped job. 0, the default, keeps every pair in memory.
+	// A round that spilled a run reduces as if streamingReduce were set, so
+	// the key groups merged from the runs are reduced as they come instead
+	// of all being held until the shuffle is over.
+	size_t spillPairs;
+
+	// where spill files go; TMPDIR (or /tmp) when null. The files are
+	// removed as soon as they are created.
+	const char* spillDirectory;
+
+	// when set, the job records what each of its threads does and when, for
+	// writeJobTrace.
+	bool trace;
+
+	// when set and the pool's threads are pinned to cpus of several NUMA
+	// nodes (see setWorkerAffinity), each of the job's threads gets a home
+	// node, in proportion to the pool threads pinned there, and runs on them
+	// whenever one is free. The pairs it emits and the groups it shuffles
+	// are thus first touched, and placed, on its home node, neighbouring
+	// threads share a node and so a span of keys, and reduce takes the
+	// groups shuffled on its own node before any other's.
+	bool nodeLocal;
+
+	// when above 1, the job runs up to this many rounds of map and reduce
+	// on the same workers and buffers: each round maps the output of the one
+	// before, without it leaving the framework, and only the last round's
+	// output is appended to outputVec. every round goes through the stages
+	// anew (see getJobState), though stage callbacks run in the first round
+	// only (see onJobStage).
+	int rounds;
+
+	// turns an output pair of a round into an input pair of the next,
+	// taking it over. when null, the output key and value must also derive
+	// from K1 and V1 (the job exits with an error otherwise), and are passed
+	// on as they are. the framework deletes the input key and value once
+	// mapped, so output built with jobNew needs a feed that copies it.
+	FeedFunc feed;
+
+	// when set, called after every round but the last with the round (from
+	// 1), its output and convergedArg. returning true ends the job with that
+	// output.
+	ConvergedFunc converged;
+	void* convergedArg;
+
+	JobOptions() : keyHash(nullptr), keyEqual(nullptr), sortedOutput(false),
+		streamingReduce(false), weight(1), spillPairs(0),
+		spillDirectory(nullptr), trace(false), nodeLocal(false), rounds(1),
+		feed(nullptr), converged(nullptr), convergedArg(nullptr) { }
+};
+
+// what one of a job's threads has done so far.
+struct ThreadMetrics {
+	uint64_t itemsMapped;
+	// pairs emitted by map; those a combine emits in their place are not
+	// counted.
+	uint64_t pairsEmitted;
+	uint64_t groupsReduced;
+	// time spent done with a step while other threads still worked on it,
+	// i.e. waiting at what used to be the barrier between stages.
+	double waitMs;
+};
+
+// where a job's time went, as of the getJobMetrics call. The time of a
+// stage that is still running counts up to the call, and in a job of
+// several rounds, each stage's time is summed over the rounds.
+struct JobMetrics {
+	double mapMs;
+	double shuffleMs;
+	double reduceMs;
+	// the rounds started so far (see JobOptions::rounds).
+	int rounds;
+	// the most pairs a single reduce call got.
+	uint64_t largestGroup;
+	std::vector<ThreadMetrics> threads;
+};
+
 void emit2 (K2* key, V2* value, void* context);
 void emit3 (K3* key, V3* value, void* context);
 
+// allocates memory from the job's arena for the calling thread, given the
+// context passed to map, combine or reduce. Takes no lock. Everything
+// allocated this way is released at once by closeJobHandle, so it must never
+// be deleted (override MapReduceClient::dispose when spilling such pairs),
+// and output pairs built in it must be read before the handle is closed.
+// alignment must be a power of two, and may exceed alignof(std::max_align_t).
+void* jobAllocate(void* context, size_t size, size_t alignment);
+
+// has destroy(object) run when the job's arena is released.
+void jobRegisterDestructor(void* context, void* object, void (*destroy)(void*));
+
+// constructs a T in the job's arena (see jobAllocate). Its destructor, if
+// it has one, runs at closeJobHandle.
+template <typename T, typename... Args>
+T* jobNew(void* context, Args&&... args) {
+	T* object = new (jobAllocate(context, sizeof(T), alignof(T)))
+		T(std::forward<Args>(args)...);
+	if (!std::is_trivially_destructible<T>::value) {
+		jobRegisterDestructor(context, object,
+			[](void* p) { static_cast<T*>(p)->~T(); });
+	}
+	return object;
+}
+
+// starts a job of multiThreadLevel workers (1 if it is below 1). The
+// workers run as tasks on the shared pool, so multiThreadLevel caps the
+// job's share of the pool's threads rather than adding threads: a map or
+// reduce that blocks or sleeps holds a pool thread meanwhile, and workers
+// beyond the pool's size wait their turn. A client that blocks should size
+// the pool for it (see setWorkerPoolSize).
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	const InputVec& inputVec, OutputVec& outputVec,
+	int multiThreadLevel);
 JobHandle startMapReduceJob(const MapReduceClient& client,
 	const InputVec& inputVec, OutputVec& outputVec,
+	int multiThreadLevel, const JobOptions& options);
+
+// like the above, but the input is pulled from source while the job maps
+// (see InputSource). The source must outlive the job. Until the source is
+// exhausted, the map percentage is based on its sizeHint (0 if it has none).
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	InputSource& source, OutputVec& outputVec,
 	int multiThreadLevel);
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	InputSource& source, OutputVec& outputVec,
+	int multiThreadLevel, const JobOptions& options);
+
+// all jobs run on one shared pool of worker threads, sized to the number of
+// cores unless this is called before the first job starts. A job's
+// multiThreadLevel caps how many of the pool's threads it uses at once.
+void setWorkerPoolSize(int numThreads);
+
+// pins the shared pool's threads, round robin, to the given cpus when the
+// pool is created; like setWorkerPoolSize, it must be called before the
+// first job starts. A thread that cannot be pinned runs unpinned.
+void setWorkerAffinity(const std::vector<int>& cpus);
 
 void waitForJob(JobHandle job);
+
+// waits up to timeoutMs for the job to finish. returns whether it has. A
+// timeout that is not finite, or of 1e12 ms or more, waits until it is.
+bool waitForJob(JobHandle job, double timeoutMs);
+
+// a callback of the job's, run on one of the pool's threads. It must not
+// block, and must neither wait for nor close the job.
+typedef void (*JobCallback)(JobHandle job, void* arg);
+
+// has callback(job, arg) run once the job enters stage, or right away, on
+// the calling thread, if it already has (as it has MAP_STAGE by the time
+// startMapReduceJob returns). a callback runs once per job: in a job of
+// several rounds, when the first round enters stage, and right away once
+// it has. exits if stage is not one of stage_t's.
+void onJobStage(JobHandle job, stage_t stage, JobCallback callback, void* arg);
+
+// has callback(job, arg) run once the job is done, just before waitForJob
+// returns, or right away, on the calling thread, if it already is.
+void onJobDone(JobHandle job, JobCallback callback, void* arg);
+
+// returns an eventfd that becomes readable once the job is done, for poll,
+// select or epoll; it stays readable until read. The descriptor belongs to
+// the job and is closed by closeJobHandle. returns -1 (with errno set) if it
+// cannot be created.
+int jobEventFd(JobHandle job);
+
 void getJobState(JobHandle job, JobState* state);
+void getJobMetrics(JobHandle job, JobMetrics* metrics);
+
+// waits for the job and writes what its threads did (JobOptions::trace) to
+// path as Chrome trace-event JSON, for chrome://tracing or Perfetto.
+// returns false if the job was not traced or the file cannot be written.
+bool writeJobTrace(JobHandle job, const char* path);
 void closeJobHandle(JobHandle job);
 	
 	
@@ -0,0 +1,378 @@
+#ifndef MAPREDUCEJOB_H
+#define MAPREDUCEJOB_H
+#include "MapReduceClient.h"
+#include "ThreadPool.h"
+#include "WorkClaim.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#define JOB_SHUFFLE_OVERSAMPLING 16
+
+/**
+ * Returns the shared pool's queue for MapReduceJob's tasks. Created on first
+ * use and never destroyed, like the pool.
+ */
+inline ThreadPool::TaskQueue* templateJobQueue() {
+    static ThreadPool::TaskQueue* queue = sharedPool().createQueue(1);
+    return queue;
+}
+
+/**
+ * Orders pointers by the objects they point to. Lets key types of the
+ * virtual API (K2*, ordered by K2::operator<) run through MapReduceJob.
+ */
+struct PointeeLess {
+    template <typename P>
+    bool operator()(const P& x, const P& y) const { return *x < *y; }
+};
+
+/**
+ * A MapReduce job over value types, alongside the virtual API of
+ * MapReduceFramework.h, whose clients it can run as well (see ClientAdapter).
+ *
+ * Keys and values are stored inline in contiguous vectors and compared with
+ * Less, which the compiler can inline, so sorting and merging intermediate
+ * pairs involve no pointer chasing and no virtual calls. The phases match
+ * the virtual API: every thread maps chunks of the input and sorts what it
+ * emitted, then each thread merges one key range of all the sorted runs and
+ * reduces its groups as it builds them. The threads are those of the shared
+ * pool (see setWorkerPoolSize), which the job shares with every other job.
+ *
+ * The client is any type with
+ *     void map(const K1&, const V1&, Context&) const;
+ *     void reduce(const IntermediateVec& pairs, Context&) const;
+ * where reduce gets all the pairs of one key (at least one) and both emit
+ * through the Context.
+ */
+template <typename K1, typename V1, typename K2, typename V2,
+          typename K3, typename V3, typename Less = std::less<K2>>
+class MapReduceJob {
+public:
+    typedef std::pair<K1, V1> InputPair;
+    typedef std::pair<K2, V2> IntermediatePair;
+    typedef std::pair<K3, V3> OutputPair;
+    typedef std::vector<InputPair> InputVec;
+    typedef std::vector<IntermediatePair> IntermediateVec;
+    typedef std::vector<OutputPair> OutputVec;
+
+    /**
+     * One thread's view of the job, handed to map and reduce.
+     */
+    class Context {
+    public:
+        void emit2(K2 key, V2 value) {
+            intermediate.emplace_back(std::move(key), std::move(value));
+        }
+        void emit3(K3 key, V3 value) {
+            output.emplace_back(std::move(key), std::move(value));
+        }
+
+    private:
+        friend class MapReduceJob;
+        IntermediateVec intermediate;
+        OutputVec output;
+    };
+
+    /**
+     * Runs the job in multiThreadLevel parts at a time (the calling thread
+     * takes part) and appends its output to outputVec, grouped by ascending
+     * key range. Returns once the job is done, so it must not be called from
+     * a task of the shared pool, such as a map, reduce or job callback.
+     */
+    template <typename Client>
+    static void run(const Client& client, const InputVec& inputVec,
+                    OutputVec& outputVec, int multiThreadLevel,
+                    Less less = Less()) {
+        int threads = std::max(1, multiThreadLevel);
+        std::vector<Context> contexts(threads);
+        PairLess pairLess = {less};
+
+        std::atomic<uint64_t> next(0);
+        runThreads(threads, [&](int id) {
+            Context& context = contexts[id];
+            uint64_t begin;
+            uint64_t size;
+            while ((size = claimChunk(next, inputVec.size(), threads, begin)) > 0) {
+                for (uint64_t i = begin; i < begin + size; ++i) {
+                    client.map(inputVec[i].first, inputVec[i].second, context);
+                }
+            }
+            std::sort(context.intermediate.begin(), context.intermediate.end(),
+                      pairLess);
+        });
+
+        // Every window is located before any thread moves pairs out of the
+        // runs, since the binary searches read outside their own range.
+        std::vector<K2> splitters = chooseSplitters(contexts, threads, less);
+        std::vector<std::vector<Window>> windows(threads);
+        for (int id = 0; id < threads; ++id) {
+            for (Context& context : contexts) {
+                Window window = findWindow(context.intermediate, splitters, id, less);
+                if (window.begin != window.end) {
+                    windows[id].push_back(window);
+                }
+            }
+        }
+
+        runThreads(threads, [&](int id) {
+            mergeAndReduce(client, windows[id], contexts[id], less);
+        });
+
+        size_t total = outputVec.size();
+        for (Context& context : contexts) {
+            total += context.output.size();
+        }
+        outputVec.reserve(total);
+        for (Context& context : contexts) {
+            std::move(context.output.begin(), context.output.end(),
+                      std::back_inserter(outputVec));
+        }
+    }
+
+private:
+    typedef typename IntermediateVec::iterator Iterator;
+
+    /**
+     * A [begin, end) window of one sorted run.
+     */
+    struct Window {
+        Iterator begin;
+        Iterator end;
+    };
+
+    struct PairLess {
+        Less less;
+        bool operator()(const IntermediatePair& x, const IntermediatePair& y) const {
+            return less(x.first, y.first);
+        }
+    };
+
+    /**
+     * Orders windows so that a max-heap holds the smallest front key on top.
+     */
+    struct WindowGreater {
+        Less less;
+        bool operator()(const Window& x, const Window& y) const {
+            return less(y.begin->first, x.begin->first);
+        }
+    };
+
+    /**
+     * task(0) .. task(threads - 1), claimed one at a time by the calling
+     * thread and by pool tasks. A pool task that runs after every id is
+     * claimed finds nothing left, so it may outlive the call that made it.
+     */
+    struct Gang {
+        std::function<void(int)> task;
+        int tasks;
+        std::atomic<int> next;
+        std::mutex mutex;
+        std::condition_variable cv;
+        int done;
+
+        void work() {
+            int ran = 0;
+            int id;
+            while ((id = next.fetch_add(1)) < tasks) {
+                task(id);
+                ++ran;
+            }
+            if (ran > 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done += ran;
+                if (done == tasks) {
+                    cv.notify_all();
+                }
+            }
+        }
+    };
+
+    /**
+     * Runs task(0) .. task(threads - 1) in parallel on the shared pool and
+     * the calling thread, and waits for all of them. The calling thread runs
+     * whatever the pool has not started, so a busy pool only slows it down.
+     */
+    template <typename Task>
+    static void runThreads(int threads, Task task) {
+        std::shared_ptr<Gang> gang = std::make_shared<Gang>();
+        gang->task = task;
+        gang->tasks = threads;
+        gang->next.store(0);
+        gang->done = 0;
+        for (int id = 1; id < threads; ++id) {
+            sharedPool().submit(templateJobQueue(), [gang] { gang->work(); });
+        }
+        gang->work();
+        std::unique_lock<std::mutex> lock(gang->mutex);
+        gang->cv.wait(lock, [&gang] { return gang->done == gang->tasks; });
+    }
+
+    /**
+     * Picks threads - 1 key-range boundaries from a sample of every sorted
+     * run, as chooseSplitters does for the virtual API.
+     */
+    static std::vector<K2> chooseSplitters(const std::vector<Context>& contexts,
+                                           int threads, const Less& less) {
+        std::vector<K2> splitters;
+        size_t total = 0;
+        for (const Context& context : contexts) {
+            total += context.intermediate.size();
+        }
+        if (threads < 2 || total == 0) {
+            return splitters;
+        }
+        size_t wanted = static_cast<size_t>(threads) * JOB_SHUFFLE_OVERSAMPLING;
+        size_t stride = std::max<size_t>(1, total / wanted);
+        std::vector<K2> samples;
+        for (const Context& context : contexts) {
+            const IntermediateVec& run = context.intermediate;
+            for (size_t i = stride / 2; i < run.size(); i += stride) {
+                samples.push_back(run[i].first);
+            }
+        }
+        if (samples.empty()) {
+            return splitters;
+        }
+        std::sort(samples.begin(), samples.end(), less);
+        for (int i = 1; i < threads; ++i) {
+            splitters.push_back(samples[(i * samples.size()) / threads]);
+        }
+        return splitters;
+    }
+
+    /**
+     * Returns the window of a sorted run holding thread id's key range,
+     * [splitters[id - 1], splitters[id]).
+     */
+    static Window findWindow(IntermediateVec& run, const std::vector<K2>& splitters,
+                             int id, const Less& less) {
+        Window window = {run.begin(), run.end()};
+        auto keyBelow = [&less](const IntermediatePair& pair, const K2& key) {
+            return less(pair.first, key);
+        };
+        if (id > static_cast<int>(splitters.size())) {
+            window.begin = window.end;
+            return window;
+        }
+        if (id > 0) {
+            window.begin = std::lower_bound(window.begin, window.end,
+                                            splitters[id - 1], keyBelow);
+        }
+        if (id < static_cast<int>(splitters.size())) {
+            window.end = std::lower_bound(window.begin, window.end,
+                                          splitters[id], keyBelow);
+        }
+        return window;
+    }
+
+    /**
+     * Merges the windows of one key range through a heap on their front
+     * keys, moving each key's pairs into a scratch group that is reduced as
+     * soon as it is complete.
+     */
+    template <typename Client>
+    static void mergeAndReduce(const Client& client, std::vector<Window>& heap,
+                               Context& context, const Less& less) {
+        WindowGreater greater = {less};
+        std::make_heap(heap.begin(), heap.end(), greater);
+        IntermediateVec group;
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            Window& window = heap.back();
+            if (!group.empty() && less(group.front().first, window.begin->first)) {
+                client.reduce(group, context);
+                group.clear();
+            }
+            group.push_back(std::move(*window.begin));
+            ++window.begin;
+            if (window.begin == window.end) {
+                heap.pop_back();
+            } else {
+                std::push_heap(heap.begin(), heap.end(), greater);
+            }
+        }
+        if (!group.empty()) {
+            client.reduce(group, context);
+        }
+    }
+};
+
+/**
+ * Receives the pairs a MapReduceClient emits while ClientAdapter runs it:
+ * emit2 and emit3 hand their pairs here when the context they are given is
+ * the calling thread's adapterEmitter.
+ */
+class AdapterEmitter {
+public:
+    virtual ~AdapterEmitter() { }
+    virtual void emit2(K2* key, V2* value) = 0;
+    virtual void emit3(K3* key, V3* value) = 0;
+};
+
+/**
+ * The emitter of the map or reduce call ClientAdapter is running on the
+ * calling thread, or null (defined in MapReduceFramework.cpp).
+ */
+extern thread_local AdapterEmitter* adapterEmitter;
+
+/**
+ * MapReduceJob over the virtual API's pointers: InputVec, IntermediateVec and
+ * OutputVec are those of MapReduceClient.h, and keys compare through
+ * K2::operator<.
+ */
+typedef MapReduceJob<K1*, V1*, K2*, V2*, K3*, V3*, PointeeLess> ClientJob;
+
+/**
+ * Runs a MapReduceClient through MapReduceJob, as in
+ *     ClientJob::run(ClientAdapter(client), inputVec, outputVec, threads);
+ * The client's map and reduce emit through emit2 and emit3 as they would in
+ * a job of MapReduceFramework.h, and own the pairs they get alike. There is
+ * no combine pass and no arena: jobAllocate exits if given their context.
+ */
+class ClientAdapter {
+public:
+    explicit ClientAdapter(const MapReduceClient& client) : client(client) { }
+
+    void map(K1* const& key, V1* const& value, ClientJob::Context& context) const {
+        ContextEmitter emitter(context);
+        client.map(key, value, &emitter);
+    }
+
+    void reduce(const ClientJob::IntermediateVec& pairs,
+                ClientJob::Context& context) const {
+        ContextEmitter emitter(context);
+        client.reduce(&pairs, &emitter);
+    }
+
+private:
+    /**
+     * Emits into a Context, as the thread's adapterEmitter while it lives.
+     */
+    class ContextEmitter : public AdapterEmitter {
+    public:
+        explicit ContextEmitter(ClientJob::Context& context)
+                : context(context)
+                , outer(adapterEmitter)
+        {
+            adapterEmitter = this;
+        }
+        ~ContextEmitter() { adapterEmitter = outer; }
+        void emit2(K2* key, V2* value) { context.emit2(key, value); }
+        void emit3(K3* key, V3* value) { context.emit3(key, value); }
+
+    private:
+        ClientJob::Context& context;
+        AdapterEmitter* outer;
+    };
+
+    const MapReduceClient& client;
+};
+
+#endif // MAPREDUCEJOB_H
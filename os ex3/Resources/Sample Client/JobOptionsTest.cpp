@@ -0,0 +1,1380 @@
+#include "../../MapReduceFramework.h"
+#include "../../MapReduceJob.h"
+#include "../../ThreadPool.h"
+#include "../../Topology.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Behaviour tests of the framework's options and extensions. Most run a
+// feature on the same input as a job with default options, and check that
+// it gives the same output.
+
+typedef std::map<long, long> Counts;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+// a key that can be the input, intermediate and output key of a job.
+class KInt : public K1, public K2, public K3 {
+public:
+	KInt(long v) : v(v) { }
+	virtual bool operator<(const K1 &other) const {
+		return v < dynamic_cast<const KInt&>(other).v;
+	}
+	virtual bool operator<(const K2 &other) const {
+		return v < dynamic_cast<const KInt&>(other).v;
+	}
+	virtual bool operator<(const K3 &other) const {
+		return v < dynamic_cast<const KInt&>(other).v;
+	}
+	long v;
+};
+
+class VInt : public V1, public V2, public V3 {
+public:
+	VInt(long v) : v(v) { }
+	long v;
+};
+
+// an input record: emits `pairs` pairs of pseudo random keys below `keys`,
+// every other one of them on key 0 when skewed.
+class VGen : public V1 {
+public:
+	VGen(long pairs, unsigned seed, long keys, bool skewed)
+		: pairs(pairs), seed(seed), keys(keys), skewed(skewed) { }
+
+	// the key of the next pair, advancing state (which starts at seed).
+	long nextKey(long i, unsigned& state) const {
+		state = state * 1103515245u + 12345u;
+		return skewed && i % 2 == 0 ? 0 : (state >> 8) % keys;
+	}
+
+	long pairs;
+	unsigned seed;
+	long keys;
+	bool skewed;
+};
+
+static long keyOf(const K2* key) {
+	return dynamic_cast<const KInt*>(key)->v;
+}
+
+static long valueOf(const V2* value) {
+	return dynamic_cast<const VInt*>(value)->v;
+}
+
+// counts the keys the records emit.
+class CountClient : public MapReduceClient {
+public:
+	CountClient() : serialized(0) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		const VGen* gen = dynamic_cast<const VGen*>(value);
+		unsigned state = gen->seed;
+		for (long i = 0; i < gen->pairs; i++) {
+			emit2(new KInt(gen->nextKey(i, state)), new VInt(1), context);
+		}
+	}
+
+	void reduce(const IntermediateVec* pairs, void* context) const {
+		long k = keyOf(pairs->at(0).first);
+		long sum = 0;
+		for (const IntermediatePair& pair : *pairs) {
+			if (keyOf(pair.first) != k) {
+				check(false, "reduce got a mixed group");
+			}
+			sum += valueOf(pair.second);
+			delete pair.first;
+			delete pair.second;
+		}
+		emit3(new KInt(k), new VInt(sum), context);
+	}
+
+	bool serialize(const K2* key, const V2* value, std::string& out) const {
+		long record[2] = {keyOf(key), valueOf(value)};
+		serialized++;
+		out.append(reinterpret_cast<const char*>(record), sizeof(record));
+		return true;
+	}
+
+	IntermediatePair deserialize(const char* data, size_t size) const {
+		long record[2];
+		check(size == sizeof(record), "spilled record size");
+		memcpy(record, data, sizeof(record));
+		return IntermediatePair(new KInt(record[0]), new VInt(record[1]));
+	}
+
+	// the pairs spilled so far.
+	mutable std::atomic<long> serialized;
+};
+
+// a CountClient whose combine sums pairs two at a time, so a group only
+// halves and stays big enough to be split.
+class CombiningClient : public CountClient {
+public:
+	bool combine(const IntermediateVec* pairs, void* context) const {
+		long k = keyOf(pairs->at(0).first);
+		for (size_t i = 0; i < pairs->size(); i += 2) {
+			long sum = valueOf(pairs->at(i).second);
+			if (i + 1 < pairs->size()) {
+				sum += valueOf(pairs->at(i + 1).second);
+			}
+			emit2(new KInt(k), new VInt(sum), context);
+		}
+		for (const IntermediatePair& pair : *pairs) {
+			delete pair.first;
+			delete pair.second;
+		}
+		return true;
+	}
+};
+
+// a client whose map waits until `release` is set, so a job can be held
+// in its map stage.
+class GateClient : public CountClient {
+public:
+	GateClient() : release(false) { }
+	void map(const K1* key, const V1* value, void* context) const {
+		while (!release.load()) {
+			usleep(1000);
+		}
+		CountClient::map(key, value, context);
+	}
+	mutable std::atomic<bool> release;
+};
+
+static size_t hashKey(const K2* key) {
+	return static_cast<size_t>(keyOf(key)) * 11400714819323198485ull;
+}
+
+static bool equalKeys(const K2* a, const K2* b) {
+	return keyOf(a) == keyOf(b);
+}
+
+// deletes the output, returning it as counts. Checks that no key repeats
+// and, when sorted, that the keys ascend.
+static Counts takeOutput(OutputVec& outputVec, bool sorted) {
+	Counts counts;
+	long last = 0;
+	for (size_t i = 0; i < outputVec.size(); i++) {
+		long k = dynamic_cast<KInt*>(outputVec[i].first)->v;
+		check(counts.count(k) == 0, "key output twice");
+		check(!sorted || i == 0 || last < k, "output not sorted");
+		counts[k] = dynamic_cast<VInt*>(outputVec[i].second)->v;
+		last = k;
+		delete outputVec[i].first;
+		delete outputVec[i].second;
+	}
+	outputVec.clear();
+	return counts;
+}
+
+static Counts runJob(const MapReduceClient& client, const InputVec& inputVec,
+		int threads, const JobOptions& options) {
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads,
+		options);
+	waitForJob(job);
+	JobState state;
+	getJobState(job, &state);
+	check(state.stage == REDUCE_STAGE && state.percentage == 100.0f,
+		"finished job not at 100% reduce");
+	closeJobHandle(job);
+	return takeOutput(outputVec, options.sortedOutput);
+}
+
+struct GenInput {
+	GenInput(int records, long pairs, long keys, bool skewed) {
+		for (int i = 0; i < records; i++) {
+			values.push_back(new VGen(pairs, 7919 * i + 1, keys, skewed));
+			input.push_back(InputPair(nullptr, values.back()));
+		}
+	}
+	~GenInput() {
+		for (VGen* value : values) {
+			delete value;
+		}
+	}
+	InputVec input;
+	std::vector<VGen*> values;
+};
+
+static void testModes() {
+	GenInput gen(40, 500, 1000, false);
+	CountClient plain;
+	CombiningClient combining;
+	for (int threads : {1, 3, 8}) {
+		Counts expected = runJob(plain, gen.input, threads, JobOptions());
+		check(!expected.empty(), "default job gave no output");
+
+		JobOptions hashed;
+		hashed.keyHash = hashKey;
+		hashed.keyEqual = equalKeys;
+		check(runJob(plain, gen.input, threads, hashed) == expected,
+			"keyHash/keyEqual");
+
+		check(runJob(combining, gen.input, threads, JobOptions()) == expected,
+			"combiner");
+
+		JobOptions streaming;
+		streaming.streamingReduce = true;
+		check(runJob(plain, gen.input, threads, streaming) == expected,
+			"streamingReduce");
+		check(runJob(combining, gen.input, threads, streaming) == expected,
+			"streamingReduce with combiner");
+
+		JobOptions sorted;
+		sorted.sortedOutput = true;
+		check(runJob(plain, gen.input, threads, sorted) == expected,
+			"sortedOutput");
+		sorted.streamingReduce = true;
+		check(runJob(plain, gen.input, threads, sorted) == expected,
+			"sortedOutput with streamingReduce");
+	}
+
+	// a level below 1 runs the job on one worker.
+	Counts expected = runJob(plain, gen.input, 1, JobOptions());
+	for (int threads : {0, -3}) {
+		check(runJob(plain, gen.input, threads, JobOptions()) == expected,
+			"multiThreadLevel below 1");
+	}
+}
+
+// with the only worker held busy while tasks are queued, a queue of weight 2
+// then runs two tasks for each one of a queue of weight 1.
+static void testWeights() {
+	ThreadPool pool(1);
+	ThreadPool::TaskQueue* gate = pool.createQueue(1);
+	ThreadPool::TaskQueue* light = pool.createQueue(1);
+	ThreadPool::TaskQueue* heavy = pool.createQueue(2);
+	// 1 once the gate task runs, 2 to let it end.
+	std::atomic<int> gateState(0);
+	pool.submit(gate, [&gateState] {
+		gateState.store(1);
+		while (gateState.load() != 2) {
+			usleep(1000);
+		}
+	});
+	while (gateState.load() != 1) {
+		usleep(1000);
+	}
+
+	const int tasks = 300;
+	std::vector<char> order(2 * tasks);
+	// written by the pool's one worker only.
+	std::atomic<int> ran(0);
+	for (int i = 0; i < tasks; i++) {
+		pool.submit(light, [&order, &ran] {
+			order[ran.load()] = 'l';
+			ran.store(ran.load() + 1);
+		});
+		pool.submit(heavy, [&order, &ran] {
+			order[ran.load()] = 'h';
+			ran.store(ran.load() + 1);
+		});
+	}
+	gateState.store(2);
+	while (ran.load() < 2 * tasks) {
+		usleep(1000);
+	}
+	long heavyFirst = std::count(order.begin(), order.begin() + tasks, 'h');
+	check(heavyFirst >= 190 && heavyFirst <= 210, "weight 2 gets twice the tasks");
+	pool.destroyQueue(gate);
+	pool.destroyQueue(light);
+	pool.destroyQueue(heavy);
+}
+
+// spills a run every 300 pairs, many runs per thread, which the shuffle
+// merges back.
+static void testSpill() {
+	GenInput gen(24, 800, 2000, false);
+	CountClient plain;
+	CombiningClient combining;
+	for (int threads : {1, 3, 6}) {
+		Counts expected = runJob(plain, gen.input, threads, JobOptions());
+
+		JobOptions spilling;
+		spilling.spillPairs = 300;
+		long before = plain.serialized;
+		check(runJob(plain, gen.input, threads, spilling) == expected,
+			"spillPairs");
+		check(plain.serialized - before >= 4L * threads * 300,
+			"several runs spilled per thread");
+		check(runJob(combining, gen.input, threads, spilling) == expected,
+			"spillPairs with combiner");
+		spilling.sortedOutput = true;
+		check(runJob(plain, gen.input, threads, spilling) == expected,
+			"spillPairs with sortedOutput");
+	}
+}
+
+// a CountClient without a combiner, counting the combine calls it gets.
+class NoCombineClient : public CountClient {
+public:
+	NoCombineClient() : combines(0) { }
+	bool combine(const IntermediateVec* pairs, void* context) const {
+		combines++;
+		return false;
+	}
+	mutable std::atomic<long> combines;
+};
+
+// once a combine returned false, the job stops calling it, even for the
+// runs each thread spills later.
+static void testNoCombiner() {
+	GenInput gen(24, 800, 2000, false);
+	CountClient plain;
+	for (int threads : {1, 3}) {
+		Counts expected = runJob(plain, gen.input, threads, JobOptions());
+		NoCombineClient client;
+		JobOptions spilling;
+		spilling.spillPairs = 300;
+		check(runJob(client, gen.input, threads, spilling) == expected,
+			"client without a combiner");
+		check(client.combines <= threads, "combine called once per thread at most");
+	}
+}
+
+static std::atomic<long> liveCounts(0);
+
+// an output value built in the job's arena, counted while it lives.
+class ArenaCount : public V3 {
+public:
+	ArenaCount(long v) : v(v) { liveCounts++; }
+	~ArenaCount() { liveCounts--; }
+	long v;
+};
+
+// a type aligned beyond std::max_align_t.
+struct alignas(64) CacheLine {
+	char bytes[64];
+};
+
+// scratch memory from the job's arena, filled with one byte.
+class VScratch : public V2 {
+public:
+	VScratch(const char* data, size_t size, char fill)
+		: data(data), size(size), fill(fill) { }
+	const char* data;
+	size_t size;
+	char fill;
+};
+
+// counts like CountClient, with every key and value in the job's arena.
+// With each pair, map fills a scratch block of one of the alignments with a
+// byte of the record's, which reduce finds unchanged, so no two workers
+// were handed overlapping memory.
+class ArenaClient : public MapReduceClient {
+public:
+	void map(const K1* key, const V1* value, void* context) const {
+		const VGen* gen = dynamic_cast<const VGen*>(value);
+		static const size_t alignments[] = {1, 2, 4, 8, alignof(std::max_align_t)};
+		unsigned state = gen->seed;
+		for (long i = 0; i < gen->pairs; i++) {
+			size_t alignment = alignments[i % 5];
+			size_t size = 1 + i % 40;
+			char* data = static_cast<char*>(jobAllocate(context, size, alignment));
+			check(reinterpret_cast<uintptr_t>(data) % alignment == 0,
+				"jobAllocate alignment");
+			char fill = static_cast<char>(gen->seed + i);
+			memset(data, fill, size);
+			emit2(jobNew<KInt>(context, gen->nextKey(i, state)),
+				jobNew<VScratch>(context, data, size, fill), context);
+		}
+		// over-aligned memory, within a block and in a block of its own.
+		check(reinterpret_cast<uintptr_t>(jobNew<CacheLine>(context)) % 64 == 0,
+			"over-aligned jobNew");
+		void* large = jobAllocate(context, 20000, 4096);
+		check(reinterpret_cast<uintptr_t>(large) % 4096 == 0,
+			"over-aligned large jobAllocate");
+		memset(large, 0, 20000);
+	}
+
+	void reduce(const IntermediateVec* pairs, void* context) const {
+		for (const IntermediatePair& pair : *pairs) {
+			const VScratch* scratch = static_cast<const VScratch*>(pair.second);
+			for (size_t i = 0; i < scratch->size; i++) {
+				if (scratch->data[i] != scratch->fill) {
+					check(false, "arena memory overwritten");
+					break;
+				}
+			}
+		}
+		emit3(jobNew<KInt>(context, keyOf(pairs->at(0).first)),
+			jobNew<ArenaCount>(context, static_cast<long>(pairs->size())),
+			context);
+	}
+};
+
+// output built with jobNew can be read until closeJobHandle, which runs
+// its destructors.
+static void testArena() {
+	GenInput gen(40, 500, 1000, false);
+	CountClient plain;
+	Counts expected = runJob(plain, gen.input, 3, JobOptions());
+	ArenaClient client;
+	for (int threads : {1, 3, 8}) {
+		OutputVec outputVec;
+		JobHandle job = startMapReduceJob(client, gen.input, outputVec, threads);
+		waitForJob(job);
+		Counts counts;
+		for (const OutputPair& pair : outputVec) {
+			counts[dynamic_cast<KInt*>(pair.first)->v] =
+				static_cast<ArenaCount*>(pair.second)->v;
+		}
+		check(counts == expected, "arena output");
+		check(liveCounts.load() == static_cast<long>(expected.size()),
+			"arena objects live until closeJobHandle");
+		closeJobHandle(job);
+		check(liveCounts.load() == 0, "closeJobHandle destroys arena objects");
+	}
+}
+
+typedef MapReduceJob<int, VGen, long, long, long, long> CountJob;
+
+// CountClient over value types, for MapReduceJob.
+class TemplateCountClient {
+public:
+	void map(const int& key, const VGen& gen, CountJob::Context& context) const {
+		unsigned state = gen.seed;
+		for (long i = 0; i < gen.pairs; i++) {
+			context.emit2(gen.nextKey(i, state), 1);
+		}
+	}
+
+	void reduce(const CountJob::IntermediateVec& pairs,
+			CountJob::Context& context) const {
+		long sum = 0;
+		for (const CountJob::IntermediatePair& pair : pairs) {
+			if (pair.first != pairs.front().first) {
+				check(false, "template reduce got a mixed group");
+			}
+			sum += pair.second;
+		}
+		context.emit3(pairs.front().first, sum);
+	}
+};
+
+static Counts runTemplateJob(const GenInput& gen, int threads) {
+	CountJob::InputVec input;
+	for (VGen* value : gen.values) {
+		input.push_back(CountJob::InputPair(0, *value));
+	}
+	CountJob::OutputVec output;
+	CountJob::run(TemplateCountClient(), input, output, threads);
+	Counts counts;
+	for (size_t i = 0; i < output.size(); i++) {
+		check(i == 0 || output[i - 1].first < output[i].first,
+			"template output not in key order");
+		counts[output[i].first] = output[i].second;
+	}
+	return counts;
+}
+
+// MapReduceJob gives the output of the virtual API.
+static void testTemplateJob() {
+	GenInput gen(40, 500, 1000, true);
+	CountClient plain;
+	Counts expected = runJob(plain, gen.input, 3, JobOptions());
+	for (int threads : {1, 3, 8}) {
+		check(runTemplateJob(gen, threads) == expected, "MapReduceJob");
+	}
+
+	// it runs on the shared pool; while a held job keeps the pool's threads
+	// busy, the calling thread does the work.
+	GateClient gate;
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(gate, gen.input, outputVec, 8);
+	check(runTemplateJob(gen, 4) == expected, "MapReduceJob on a busy pool");
+	gate.release.store(true);
+	waitForJob(job);
+	closeJobHandle(job);
+	check(takeOutput(outputVec, false) == expected, "held job output");
+
+	// a client of the virtual API runs through ClientAdapter, keys in order.
+	for (int threads : {1, 3, 8}) {
+		ClientJob::run(ClientAdapter(plain), gen.input, outputVec, threads);
+		check(takeOutput(outputVec, true) == expected, "ClientAdapter");
+	}
+}
+
+enum PrefixMode {EXACT_PREFIX, TRUNCATED_PREFIX, MISSING_PREFIX};
+
+// a key with a normalized prefix: the value itself (exact), or its value
+// with the low 20 bits cleared, so that neighbouring keys share a prefix and
+// are told apart by operator<. With MISSING_PREFIX, key 0 has no prefix,
+// which makes the whole sort fall back to operator<.
+class PrefixKey : public K2, public K3 {
+public:
+	PrefixKey(long v, PrefixMode mode) : v(v), mode(mode) { }
+	virtual bool operator<(const K2 &other) const {
+		return v < dynamic_cast<const PrefixKey&>(other).v;
+	}
+	virtual bool operator<(const K3 &other) const {
+		return v < dynamic_cast<const PrefixKey&>(other).v;
+	}
+	bool normalizedPrefix(uint64_t &prefix, bool &exact) const {
+		if (mode == MISSING_PREFIX && v == 0) {
+			return false;
+		}
+		prefix = static_cast<uint64_t>(v) ^ (1ull << 63);
+		exact = mode != TRUNCATED_PREFIX;
+		if (!exact) {
+			prefix &= ~((1ull << 20) - 1);
+		}
+		return true;
+	}
+	long v;
+	PrefixMode mode;
+};
+
+// counts like CountClient, on keys spread over negative and positive values.
+class PrefixClient : public MapReduceClient {
+public:
+	PrefixClient(PrefixMode mode) : mode(mode) { }
+
+	static long spread(long k, long keys) {
+		return (k - keys / 2) * 7919;
+	}
+
+	void map(const K1* key, const V1* value, void* context) const {
+		const VGen* gen = dynamic_cast<const VGen*>(value);
+		unsigned state = gen->seed;
+		for (long i = 0; i < gen->pairs; i++) {
+			emit2(new PrefixKey(spread(gen->nextKey(i, state), gen->keys), mode),
+				new VInt(1), context);
+		}
+	}
+
+	void reduce(const IntermediateVec* pairs, void* context) const {
+		long k = static_cast<const PrefixKey*>(pairs->at(0).first)->v;
+		for (const IntermediatePair& pair : *pairs) {
+			if (static_cast<const PrefixKey*>(pair.first)->v != k) {
+				check(false, "reduce got a mixed group");
+			}
+			delete pair.first;
+			delete pair.second;
+		}
+		emit3(new PrefixKey(k, mode), new VInt(pairs->size()), context);
+	}
+
+	PrefixMode mode;
+};
+
+// radix sorts thousands of pairs per thread. A single thread reduces its
+// groups in the order it sorted them, which must be that of std::sort.
+static void testRadixSort() {
+	const long keys = 5000;
+	GenInput gen(4, 3000, keys, false);
+	CountClient plain;
+	Counts counts = runJob(plain, gen.input, 1, JobOptions());
+	std::vector<std::pair<long, long>> expected;
+	for (const std::pair<const long, long>& kv : counts) {
+		expected.push_back(std::make_pair(PrefixClient::spread(kv.first, keys),
+			kv.second));
+	}
+	std::sort(expected.begin(), expected.end());
+
+	for (PrefixMode mode : {EXACT_PREFIX, TRUNCATED_PREFIX, MISSING_PREFIX}) {
+		for (int threads : {1, 3}) {
+			PrefixClient client(mode);
+			OutputVec outputVec;
+			JobHandle job = startMapReduceJob(client, gen.input, outputVec,
+				threads);
+			waitForJob(job);
+			closeJobHandle(job);
+			std::vector<std::pair<long, long>> output;
+			for (OutputPair& pair : outputVec) {
+				output.push_back(std::make_pair(
+					static_cast<PrefixKey*>(pair.first)->v,
+					static_cast<VInt*>(pair.second)->v));
+				delete pair.first;
+				delete pair.second;
+			}
+			if (threads > 1) {
+				std::sort(output.begin(), output.end());
+			}
+			check(output == expected, "radix sort order");
+		}
+	}
+}
+
+// returns the contents of the file at path.
+static std::string readFile(const char* path) {
+	std::ifstream file(path);
+	return std::string(std::istreambuf_iterator<char>(file),
+		std::istreambuf_iterator<char>());
+}
+
+// the threads' metrics add up to the job's pairs and groups, and a traced
+// job writes a trace of its steps.
+static void testMetrics() {
+	GenInput gen(40, 500, 1000, false);
+	CountClient plain;
+	Counts expected = runJob(plain, gen.input, 1, JobOptions());
+	long largest = 0;
+	for (const std::pair<const long, long>& kv : expected) {
+		largest = std::max(largest, kv.second);
+	}
+	for (int threads : {1, 4}) {
+		JobOptions traced;
+		traced.trace = true;
+		OutputVec outputVec;
+		JobHandle job = startMapReduceJob(plain, gen.input, outputVec, threads,
+			traced);
+		waitForJob(job);
+		JobMetrics metrics;
+		getJobMetrics(job, &metrics);
+		check(metrics.threads.size() == static_cast<size_t>(threads),
+			"metrics of every thread");
+		uint64_t mapped = 0;
+		uint64_t emitted = 0;
+		uint64_t reduced = 0;
+		for (const ThreadMetrics& thread : metrics.threads) {
+			mapped += thread.itemsMapped;
+			emitted += thread.pairsEmitted;
+			reduced += thread.groupsReduced;
+			check(thread.waitMs >= 0, "thread wait time");
+		}
+		check(mapped == gen.input.size(), "itemsMapped");
+		check(emitted == 40 * 500, "pairsEmitted");
+		check(reduced == expected.size(), "groupsReduced");
+		check(metrics.largestGroup == static_cast<uint64_t>(largest),
+			"largestGroup");
+		check(metrics.mapMs >= 0 && metrics.shuffleMs >= 0 &&
+			metrics.reduceMs >= 0, "stage times");
+
+		char path[] = "/tmp/jobOptionsTestXXXXXX";
+		int fd = mkstemp(path);
+		check(fd >= 0, "temporary file");
+		close(fd);
+		check(writeJobTrace(job, path), "writeJobTrace");
+		std::string trace = readFile(path);
+		unlink(path);
+		check(trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0 &&
+			trace.find("\"name\":\"map\",\"ph\":\"X\"") != std::string::npos &&
+			trace.find("\"name\":\"reduce\",\"ph\":\"X\"") != std::string::npos &&
+			trace.compare(trace.size() - 4, 4, "\n]}\n") == 0, "trace JSON");
+		closeJobHandle(job);
+		check(takeOutput(outputVec, false) == expected, "traced job output");
+	}
+
+	// pairs a combine emits, after the map or for a hot group's part, are
+	// not counted as emitted.
+	GenInput skewed(16, 5000, 300, true);
+	CombiningClient combining;
+	for (const GenInput* input : {&gen, &skewed}) {
+		OutputVec outputVec;
+		JobHandle job = startMapReduceJob(combining, input->input, outputVec, 4);
+		waitForJob(job);
+		JobMetrics metrics;
+		getJobMetrics(job, &metrics);
+		uint64_t emitted = 0;
+		for (const ThreadMetrics& thread : metrics.threads) {
+			emitted += thread.pairsEmitted;
+		}
+		check(emitted == input->values.size() * input->values[0]->pairs,
+			"pairsEmitted with a combiner");
+		closeJobHandle(job);
+		takeOutput(outputVec, false);
+	}
+
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(plain, gen.input, outputVec, 2);
+	check(!writeJobTrace(job, "/tmp/jobOptionsTestUntraced"),
+		"writeJobTrace of an untraced job");
+	closeJobHandle(job);
+	takeOutput(outputVec, false);
+}
+
+// a CountClient that cannot spill its pairs.
+class NoSpillClient : public CountClient {
+public:
+	bool serialize(const K2* key, const V2* value, std::string& out) const {
+		return false;
+	}
+};
+
+// returns whether a job with spillPairs set ran merge steps, which only a
+// round reducing its groups as they are merged back runs.
+static bool spillMerged(const MapReduceClient& client, const GenInput& gen,
+		const Counts& expected) {
+	JobOptions spilling;
+	spilling.spillPairs = 300;
+	spilling.trace = true;
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(client, gen.input, outputVec, 3,
+		spilling);
+	waitForJob(job);
+	char path[] = "/tmp/jobOptionsTestXXXXXX";
+	int fd = mkstemp(path);
+	check(fd >= 0, "temporary file");
+	close(fd);
+	check(writeJobTrace(job, path), "writeJobTrace");
+	std::string trace = readFile(path);
+	unlink(path);
+	closeJobHandle(job);
+	check(takeOutput(outputVec, false) == expected, "spillPairs output");
+	return trace.find("\"name\":\"merge\"") != std::string::npos;
+}
+
+// a job reduces as its runs are merged only when it did spill.
+static void testSpillStreaming() {
+	GenInput gen(24, 800, 2000, false);
+	CountClient plain;
+	Counts expected = runJob(plain, gen.input, 3, JobOptions());
+	check(spillMerged(plain, gen, expected), "spilled job streams its reduce");
+	check(!spillMerged(NoSpillClient(), gen, expected),
+		"unspilled job reduces once shuffled");
+}
+
+static std::atomic<int> mostCpus(0);
+static std::atomic<int> fewestCpus(1 << 20);
+
+// a CountClient that notes how many cpus the threads it maps on may use.
+class AffinityClient : public CountClient {
+public:
+	void map(const K1* key, const V1* value, void* context) const {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+		int cpus = CPU_COUNT(&set);
+		int most = mostCpus.load();
+		while (cpus > most && !mostCpus.compare_exchange_weak(most, cpus)) { }
+		int fewest = fewestCpus.load();
+		while (cpus < fewest && !fewestCpus.compare_exchange_weak(fewest, cpus)) { }
+		CountClient::map(key, value, context);
+	}
+};
+
+// run in a process of its own by testAffinity, since the pool's cpus are
+// set before it is created: pins the pool to cpus (cpu 0, or cpus that
+// cannot be used), and checks where the workers run and that node-local
+// jobs give the output of the others.
+static void runAffinity(bool usable) {
+	std::vector<int> cpus = {-1, 1 << 20};
+	if (usable) {
+		cpus = {0};
+	}
+	setWorkerPoolSize(3);
+	setWorkerAffinity(cpus);
+	GenInput gen(40, 500, 1000, false);
+	AffinityClient client;
+	JobOptions local;
+	local.nodeLocal = true;
+	for (int threads : {1, 3, 8}) {
+		Counts expected = runJob(client, gen.input, threads, JobOptions());
+		check(runJob(client, gen.input, threads, local) == expected,
+			"nodeLocal");
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	sched_getaffinity(0, sizeof(set), &set);
+	if (usable) {
+		check(mostCpus.load() == 1 && fewestCpus.load() == 1,
+			"workers pinned to cpu 0");
+	} else {
+		check(fewestCpus.load() == CPU_COUNT(&set),
+			"workers left unpinned");
+	}
+}
+
+// runs this test binary again with mode as its argument, for what needs a
+// process of its own. Returns its exit status (-1 if it did not exit), and
+// what it wrote to stderr in err.
+static int runChild(const char* self, const char* mode, std::string& err) {
+	int pipeFds[2];
+	check(pipe(pipeFds) == 0, "pipe");
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(pipeFds[1], STDERR_FILENO);
+		execl(self, self, mode, (char*) nullptr);
+		_exit(2);
+	}
+	close(pipeFds[1]);
+	char buffer[256];
+	ssize_t size;
+	while ((size = read(pipeFds[0], buffer, sizeof(buffer))) > 0) {
+		err.append(buffer, size);
+	}
+	close(pipeFds[0]);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void testAffinity(const char* self) {
+	std::string err;
+	check(runChild(self, "pinned", err) == 0, "pool pinned to cpu 0");
+	check(runChild(self, "unpinned", err) == 0, "pool on unusable cpus");
+
+	// without /sys, or with a node directory of its own.
+	check(readCpuNodes("/nonexistent").empty(), "no NUMA information");
+	char root[] = "/tmp/jobOptionsTestXXXXXX";
+	check(mkdtemp(root) != nullptr, "temporary directory");
+	std::string node0 = std::string(root) + "/node0";
+	std::string node1 = std::string(root) + "/node1";
+	std::string other = std::string(root) + "/nodes";
+	mkdir(node0.c_str(), 0700);
+	mkdir(node1.c_str(), 0700);
+	mkdir(other.c_str(), 0700);
+	std::ofstream(node0 + "/cpulist") << "0-1,4\n";
+	std::ofstream(node1 + "/cpulist") << "2,5-6\n";
+	std::vector<int> nodes = readCpuNodes(root);
+	check(nodes == std::vector<int>({0, 0, 1, -1, 0, 1, 1}), "cpulist nodes");
+	std::ofstream(node0 + "/cpulist") << "";
+	check(readCpuNodes(root) == std::vector<int>({-1, -1, 1, -1, -1, 1, 1}),
+		"cpus of no node");
+	unlink((node0 + "/cpulist").c_str());
+	unlink((node1 + "/cpulist").c_str());
+	rmdir(node0.c_str());
+	rmdir(node1.c_str());
+	rmdir(other.c_str());
+	rmdir(root);
+
+	// without NUMA information, pinned workers are all on node 0; workers
+	// that cannot be pinned are on none.
+	std::vector<int> cpu0 = {0};
+	ThreadPool fallback(2, cpu0, std::vector<int>());
+	check(fallback.workersPerNode() == std::vector<int>({2}),
+		"pinned workers without NUMA information");
+	ThreadPool kernelNode(2, cpu0, std::vector<int>({3}));
+	check(kernelNode.workersPerNode() == std::vector<int>({2}),
+		"nodes numbered from 0");
+	std::vector<int> unusable = {1 << 20};
+	ThreadPool unpinned(2, unusable, std::vector<int>());
+	check(unpinned.workersPerNode().empty(), "workers left unpinned");
+}
+
+// run in a process of its own by testPoolError: must exit with an error,
+// as the address space left cannot hold the stacks of so many workers.
+static void runPoolError() {
+	setWorkerPoolSize(4096);
+	struct rlimit limit = {1L << 30, 1L << 30};
+	setrlimit(RLIMIT_AS, &limit);
+	GenInput gen(4, 10, 10, false);
+	CountClient plain;
+	runJob(plain, gen.input, 2, JobOptions());
+}
+
+// a pool that cannot start its workers exits with a system error.
+static void testPoolError(const char* self) {
+	std::string err;
+	check(runChild(self, "pool-error", err) == 1, "pool error exit status");
+	check(err.find("system error: ") == 0, "pool error message");
+}
+
+// half the pairs go to key 0, a group far bigger than a worker's share,
+// which is reduced first, and split in parts when there is a combiner.
+static void testHotGroups() {
+	GenInput gen(16, 5000, 300, true);
+	CountClient plain;
+	CombiningClient combining;
+	Counts expected = runJob(plain, gen.input, 1, JobOptions());
+	check(expected[0] >= 40000, "skewed input");
+	for (int threads : {2, 4, 8}) {
+		check(runJob(plain, gen.input, threads, JobOptions()) == expected,
+			"hot group without combiner");
+		check(runJob(combining, gen.input, threads, JobOptions()) == expected,
+			"hot group split with combiner");
+	}
+}
+
+// hands out the records of an input vector.
+class VectorSource : public InputSource {
+public:
+	VectorSource(const InputVec& input) : input(input), position(0) { }
+	bool next(InputPair& pair) {
+		if (position == input.size()) {
+			return false;
+		}
+		pair = input[position++];
+		return true;
+	}
+	uint64_t sizeHint() const { return input.size(); }
+
+	const InputVec& input;
+	size_t position;
+};
+
+// a VectorSource that blocks before the record at holdAt until release is
+// set.
+class HeldSource : public VectorSource {
+public:
+	HeldSource(const InputVec& input, size_t holdAt)
+		: VectorSource(input), holdAt(holdAt), release(false) { }
+	bool next(InputPair& pair) {
+		if (position == holdAt) {
+			while (!release.load()) {
+				usleep(1000);
+			}
+		}
+		return VectorSource::next(pair);
+	}
+
+	size_t holdAt;
+	std::atomic<bool> release;
+};
+
+// counts the lines of a MappedFileSource by length.
+class LineClient : public MapReduceClient {
+public:
+	void map(const K1* key, const V1* value, void* context) const {
+		emit2(new KInt(dynamic_cast<const FileRecord*>(value)->size),
+			new VInt(1), context);
+	}
+
+	void reduce(const IntermediateVec* pairs, void* context) const {
+		emit3(new KInt(keyOf(pairs->at(0).first)),
+			new VInt(pairs->size()), context);
+		for (const IntermediatePair& pair : *pairs) {
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+};
+
+// writes lines of lengths cycling through 0 .. 19 to a temporary file,
+// returning its path and the count of each length.
+static std::string writeLines(long lines, bool lastNewline, Counts& lengths) {
+	char path[] = "/tmp/jobOptionsTestXXXXXX";
+	int fd = mkstemp(path);
+	check(fd >= 0, "temporary file");
+	std::string text;
+	for (long i = 0; i < lines; i++) {
+		text.append(i % 20, 'x');
+		if (lastNewline || i + 1 < lines) {
+			text.push_back('\n');
+		}
+		lengths[i % 20]++;
+	}
+	check(write(fd, text.data(), text.size()) ==
+		static_cast<ssize_t>(text.size()), "write temporary file");
+	close(fd);
+	return path;
+}
+
+// a job pulling its records from a source gives the output of one given
+// them as a vector, and a file source splits the file into its lines.
+static void testSources() {
+	GenInput gen(60, 300, 500, false);
+	CountClient plain;
+	Counts expected = runJob(plain, gen.input, 3, JobOptions());
+
+	VectorSource source(gen.input);
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(plain, source, outputVec, 3);
+	waitForJob(job);
+	closeJobHandle(job);
+	check(takeOutput(outputVec, false) == expected, "source output");
+
+	// a source that blocks in next holds up only its own job.
+	HeldSource held(gen.input, 20);
+	OutputVec heldOutput;
+	JobHandle heldJob = startMapReduceJob(plain, held, heldOutput, 8);
+	job = startMapReduceJob(plain, gen.input, outputVec, 8);
+	check(waitForJob(job, 20000.0), "job finishes while a source blocks");
+	held.release.store(true);
+	waitForJob(job);
+	closeJobHandle(job);
+	check(takeOutput(outputVec, false) == expected, "job next to a source");
+	waitForJob(heldJob);
+	closeJobHandle(heldJob);
+	check(takeOutput(heldOutput, false) == expected, "held source output");
+
+	for (long lines : {0L, 7L, 200000L}) {
+		for (bool lastNewline : {true, false}) {
+			Counts lengths;
+			std::string path = writeLines(lines, lastNewline, lengths);
+			MappedFileSource fileSource(path.c_str());
+			uint64_t hint = fileSource.sizeHint();
+			check(lines < 1000 ? hint == static_cast<uint64_t>(lines)
+				: hint > lines * 0.9 && hint < lines * 1.1, "file sizeHint");
+			LineClient client;
+			job = startMapReduceJob(client, fileSource, outputVec, 4);
+			waitForJob(job);
+			closeJobHandle(job);
+			unlink(path.c_str());
+			check(takeOutput(outputVec, false) == lengths, "file lines");
+		}
+	}
+}
+
+// run in a process of its own by testProducerError: once the pool is
+// running, leaves too little address space for another thread's stack, so
+// a source job cannot start its producer and must exit with an error.
+static void runProducerError() {
+	GenInput gen(4, 10, 10, false);
+	CountClient plain;
+	runJob(plain, gen.input, 2, JobOptions());
+	long pages = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	check(statm != nullptr && fscanf(statm, "%ld", &pages) == 1, "statm");
+	fclose(statm);
+	rlim_t size = pages * sysconf(_SC_PAGESIZE) + (1 << 20);
+	struct rlimit limit = {size, size};
+	setrlimit(RLIMIT_AS, &limit);
+	VectorSource source(gen.input);
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(plain, source, outputVec, 2);
+	waitForJob(job);
+}
+
+// a source job whose producer thread cannot start exits with a system
+// error.
+static void testProducerError(const char* self) {
+	std::string err;
+	check(runChild(self, "producer-error", err) == 1,
+		"producer error exit status");
+	check(err.find("system error: ") == 0, "producer error message");
+}
+
+static std::atomic<int> events(0);
+static int eventOrder[REDUCE_STAGE + 2];
+
+static void noteEvent(JobHandle job, void* arg) {
+	eventOrder[reinterpret_cast<long>(arg)] = ++events;
+}
+
+static void testNotification() {
+	GenInput gen(8, 500, 100, false);
+	CountClient plain;
+	Counts expected = runJob(plain, gen.input, 2, JobOptions());
+
+	GateClient gate;
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(gate, gen.input, outputVec, 2);
+	onJobDone(job, noteEvent, reinterpret_cast<void*>(REDUCE_STAGE + 1));
+	onJobStage(job, REDUCE_STAGE, noteEvent, reinterpret_cast<void*>(REDUCE_STAGE));
+	onJobStage(job, SHUFFLE_STAGE, noteEvent, reinterpret_cast<void*>(SHUFFLE_STAGE));
+	onJobStage(job, MAP_STAGE, noteEvent, reinterpret_cast<void*>(MAP_STAGE));
+	check(eventOrder[MAP_STAGE] == 1, "MAP_STAGE callback runs at once");
+	int fd = jobEventFd(job);
+	check(fd >= 0, "jobEventFd");
+	struct pollfd pfd = {fd, POLLIN, 0};
+	check(poll(&pfd, 1, 0) == 0, "event fd readable before the job is done");
+	check(!waitForJob(job, 20.0), "timed wait on a held job");
+
+	gate.release.store(true);
+	check(poll(&pfd, 1, 10000) == 1, "event fd readable once done");
+	check(waitForJob(job, 0.0), "timed wait on a done job");
+	check(eventOrder[SHUFFLE_STAGE] == 2 && eventOrder[REDUCE_STAGE] == 3 &&
+		eventOrder[REDUCE_STAGE + 1] == 4, "callback order");
+	onJobDone(job, noteEvent, reinterpret_cast<void*>(0));
+	check(eventOrder[0] == 5, "onJobDone on a done job runs at once");
+	closeJobHandle(job);
+	check(takeOutput(outputVec, false) == expected, "held job output");
+
+	// timeouts too long for the clock wait for the job instead of failing.
+	for (double timeout : {1e15, 1e18, (double) INFINITY, (double) NAN}) {
+		GateClient held;
+		job = startMapReduceJob(held, gen.input, outputVec, 2);
+		std::thread releaser([&held] {
+			usleep(20000);
+			held.release.store(true);
+		});
+		check(waitForJob(job, timeout), "timed wait with a huge timeout");
+		JobState state;
+		getJobState(job, &state);
+		check(state.stage == REDUCE_STAGE && state.percentage == 100.0f,
+			"huge timeout returned before the job was done");
+		releaser.join();
+		closeJobHandle(job);
+		check(takeOutput(outputVec, false) == expected, "held job output");
+	}
+}
+
+// one round of an iterative job: key k with count c moves its count to
+// k / 3, and every key adds one to k % 13.
+class RoundClient : public MapReduceClient {
+public:
+	void map(const K1* key, const V1* value, void* context) const {
+		long k = dynamic_cast<const KInt*>(key)->v;
+		long c = dynamic_cast<const VInt*>(value)->v;
+		emit2(new KInt(k / 3), new VInt(c), context);
+		emit2(new KInt(k % 13), new VInt(1), context);
+	}
+
+	void reduce(const IntermediateVec* pairs, void* context) const {
+		long sum = 0;
+		for (const IntermediatePair& pair : *pairs) {
+			sum += valueOf(pair.second);
+		}
+		emit3(new KInt(keyOf(pairs->at(0).first)), new VInt(sum), context);
+		for (const IntermediatePair& pair : *pairs) {
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+};
+
+static InputPair copyFeed(const OutputPair& pair) {
+	InputPair input(new KInt(dynamic_cast<KInt*>(pair.first)->v),
+		new VInt(dynamic_cast<VInt*>(pair.second)->v));
+	delete pair.first;
+	delete pair.second;
+	return input;
+}
+
+static bool stopAtRound(int round, const OutputVec& output, void* arg) {
+	return round == *static_cast<int*>(arg);
+}
+
+// runs `rounds` single round jobs by hand, turning each output into the
+// next input.
+static Counts runRoundsByHand(const Counts& start, int rounds, int threads) {
+	RoundClient client;
+	Counts counts = start;
+	for (int round = 0; round < rounds; round++) {
+		InputVec input;
+		for (const std::pair<const long, long>& kv : counts) {
+			input.push_back(InputPair(new KInt(kv.first), new VInt(kv.second)));
+		}
+		counts = runJob(client, input, threads, JobOptions());
+		for (InputPair& pair : input) {
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+	return counts;
+}
+
+static void testRounds() {
+	RoundClient client;
+	Counts start;
+	InputVec input;
+	for (long i = 0; i < 3000; i++) {
+		start[i * 7] = 1;
+		input.push_back(InputPair(new KInt(i * 7), new VInt(1)));
+	}
+	for (int threads : {1, 4}) {
+		JobOptions chained;
+		chained.rounds = 4;
+		check(runJob(client, input, threads, chained) ==
+			runRoundsByHand(start, 4, threads), "rounds");
+
+		chained.feed = copyFeed;
+		chained.sortedOutput = true;
+		check(runJob(client, input, threads, chained) ==
+			runRoundsByHand(start, 4, threads), "rounds with feed");
+
+		int stopAt = 2;
+		JobOptions converging;
+		converging.rounds = 10;
+		converging.converged = stopAtRound;
+		converging.convergedArg = &stopAt;
+		OutputVec outputVec;
+		JobHandle job = startMapReduceJob(client, input, outputVec, threads,
+			converging);
+		waitForJob(job);
+		JobMetrics metrics;
+		getJobMetrics(job, &metrics);
+		check(metrics.rounds == 2, "converged rounds");
+		closeJobHandle(job);
+		check(takeOutput(outputVec, false) == runRoundsByHand(start, 2, threads),
+			"converged output");
+	}
+	for (InputPair& pair : input) {
+		delete pair.first;
+		delete pair.second;
+	}
+}
+
+// output that cannot be mapped by a next round without a feed.
+class KOut : public K3 {
+public:
+	KOut(long v) : v(v) { }
+	virtual bool operator<(const K3 &other) const {
+		return v < dynamic_cast<const KOut&>(other).v;
+	}
+	long v;
+};
+
+class VOut : public V3 { };
+
+class OutOnlyClient : public RoundClient {
+public:
+	void reduce(const IntermediateVec* pairs, void* context) const {
+		emit3(new KOut(keyOf(pairs->at(0).first)), new VOut(), context);
+		for (const IntermediatePair& pair : *pairs) {
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+};
+
+// run in a process of its own by testBadFeed: must exit with an error.
+static void runBadFeed() {
+	InputVec input;
+	for (long i = 0; i < 100; i++) {
+		input.push_back(InputPair(new KInt(i), new VInt(1)));
+	}
+	JobOptions chained;
+	chained.rounds = 2;
+	OutputVec outputVec;
+	OutOnlyClient client;
+	JobHandle job = startMapReduceJob(client, input, outputVec, 2, chained);
+	waitForJob(job);
+}
+
+// a round whose output is no K1 and V1, without a feed, exits with a
+// system error rather than mapping null pairs.
+static void testBadFeed(const char* self) {
+	std::string err;
+	check(runChild(self, "bad-feed", err) == 1, "bad feed exit status");
+	check(err.find("system error: ") == 0, "bad feed message");
+}
+
+static std::atomic<int> shuffleEvents(0);
+static std::atomic<int> reduceEvents(0);
+static std::atomic<JobHandle> stageJob(nullptr);
+static std::atomic<bool> fedRegistered(false);
+static std::atomic<bool> ranAtOnce(false);
+
+static void noteShuffle(JobHandle job, void* arg) {
+	shuffleEvents++;
+}
+
+static void noteReduce(JobHandle job, void* arg) {
+	reduceEvents++;
+}
+
+// a RoundClient whose map waits until `release` is set.
+class HeldRoundClient : public RoundClient {
+public:
+	HeldRoundClient() : release(false) { }
+	void map(const K1* key, const V1* value, void* context) const {
+		while (!release.load()) {
+			usleep(1000);
+		}
+		RoundClient::map(key, value, context);
+	}
+	mutable std::atomic<bool> release;
+};
+
+// copies like copyFeed, while the second round maps: the first time,
+// registers a SHUFFLE_STAGE callback, which the first round has entered.
+static InputPair registeringFeed(const OutputPair& pair) {
+	if (!fedRegistered.exchange(true)) {
+		int before = shuffleEvents.load();
+		onJobStage(stageJob.load(), SHUFFLE_STAGE, noteShuffle, nullptr);
+		ranAtOnce.store(shuffleEvents.load() == before + 1);
+	}
+	return copyFeed(pair);
+}
+
+// a stage callback runs once per job, in the first round, or at once if
+// registered in a later round.
+static void testStageRounds() {
+	InputVec input;
+	for (long i = 0; i < 3000; i++) {
+		input.push_back(InputPair(new KInt(i * 7), new VInt(1)));
+	}
+	HeldRoundClient client;
+	JobOptions chained;
+	chained.rounds = 3;
+	chained.feed = registeringFeed;
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(client, input, outputVec, 2, chained);
+	stageJob.store(job);
+	onJobStage(job, SHUFFLE_STAGE, noteShuffle, nullptr);
+	onJobStage(job, REDUCE_STAGE, noteReduce, nullptr);
+	client.release.store(true);
+	waitForJob(job);
+	JobMetrics metrics;
+	getJobMetrics(job, &metrics);
+	closeJobHandle(job);
+	takeOutput(outputVec, false);
+	check(metrics.rounds == 3, "three rounds");
+	check(reduceEvents.load() == 1, "stage callback runs once");
+	check(fedRegistered.load() && ranAtOnce.load() && shuffleEvents.load() == 2,
+		"stage callback registered in a later round runs at once");
+	for (InputPair& pair : input) {
+		delete pair.first;
+		delete pair.second;
+	}
+}
+
+// run in a process of its own by testStageError: must exit with an error.
+static void runStageError() {
+	GenInput gen(4, 10, 10, false);
+	CountClient plain;
+	OutputVec outputVec;
+	JobHandle job = startMapReduceJob(plain, gen.input, outputVec, 2);
+	onJobStage(job, static_cast<stage_t>(REDUCE_STAGE + 1), noteReduce, nullptr);
+	waitForJob(job);
+}
+
+// onJobStage with a stage that is none of stage_t's exits with a system
+// error.
+static void testStageError(const char* self) {
+	std::string err;
+	check(runChild(self, "stage-error", err) == 1, "stage error exit status");
+	check(err.find("system error: ") == 0, "stage error message");
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1) {
+		// a test's own process (see runChild).
+		if (strcmp(argv[1], "pinned") == 0 || strcmp(argv[1], "unpinned") == 0) {
+			runAffinity(strcmp(argv[1], "pinned") == 0);
+		}
+		if (strcmp(argv[1], "bad-feed") == 0) {
+			runBadFeed();
+		}
+		if (strcmp(argv[1], "pool-error") == 0) {
+			runPoolError();
+		}
+		if (strcmp(argv[1], "producer-error") == 0) {
+			runProducerError();
+		}
+		if (strcmp(argv[1], "stage-error") == 0) {
+			runStageError();
+		}
+		return failures ? 1 : 0;
+	}
+	testModes();
+	testWeights();
+	testSpill();
+	testNoCombiner();
+	testArena();
+	testTemplateJob();
+	testRadixSort();
+	testMetrics();
+	testSpillStreaming();
+	testAffinity(argv[0]);
+	testHotGroups();
+	testSources();
+	testNotification();
+	testRounds();
+	testBadFeed(argv[0]);
+	testPoolError(argv[0]);
+	testProducerError(argv[0]);
+	testStageRounds();
+	testStageError(argv[0]);
+	printf(failures ? "FAILED\n" : "OK\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#include "SpillRun.h"
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SYSTEM_ERROR_PREFIX "system error: "
+#define SPILL_ERROR "failed to spill intermediate data"
+#define EXIT_FAIL 1
+#define DEFAULT_SPILL_DIRECTORY "/tmp"
+#define SPILL_FILE_NAME "/mapreduce-spill-XXXXXX"
+#define SPILL_BUFFER_BYTES (1 << 20)
+
+static void spillFailed() {
+    std::cerr << SYSTEM_ERROR_PREFIX << SPILL_ERROR << std::endl;
+    exit(EXIT_FAIL);
+}
+
+/**
+ * Appends the whole buffer to the file, then empties the buffer.
+ */
+static void flushBuffer(int fd, std::string& buffer) {
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t n = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            spillFailed();
+        }
+        written += static_cast<size_t>(n);
+    }
+    buffer.clear();
+}
+
+SpillRun::~SpillRun() {
+    if (data) {
+        munmap(const_cast<char*>(data), bytes);
+    }
+}
+
+SpillRun* SpillRun::write(const MapReduceClient& client,
+                          const IntermediateVec& pairs,
+                          const char* directory) {
+    std::string buffer;
+    if (pairs.empty() ||
+        !client.serialize(pairs[0].first, pairs[0].second, buffer)) {
+        return nullptr;
+    }
+    if (!directory) {
+        directory = getenv("TMPDIR");
+        if (!directory || !*directory) {
+            directory = DEFAULT_SPILL_DIRECTORY;
+        }
+    }
+    std::string path = std::string(directory) + SPILL_FILE_NAME;
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        spillFailed();
+    }
+    unlink(path.c_str());
+
+    SpillRun* run = new SpillRun();
+    run->offsets.reserve(pairs.size() + 1);
+    run->offsets.push_back(0);
+    run->offsets.push_back(buffer.size());
+    uint64_t flushed = 0;
+    for (size_t i = 1; i < pairs.size(); ++i) {
+        if (buffer.size() >= SPILL_BUFFER_BYTES) {
+            flushed += buffer.size();
+            flushBuffer(fd, buffer);
+        }
+        if (!client.serialize(pairs[i].first, pairs[i].second, buffer)) {
+            close(fd);
+            delete run;
+            return nullptr;
+        }
+        run->offsets.push_back(flushed + buffer.size());
+    }
+    flushBuffer(fd, buffer);
+
+    run->bytes = run->offsets.back();
+    if (run->bytes > 0) {
+        void* mapped = mmap(nullptr, run->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            spillFailed();
+        }
+        run->data = static_cast<const char*>(mapped);
+    }
+    close(fd);
+    return run;
+}
+
+IntermediatePair SpillRun::read(const MapReduceClient& client, size_t i) const {
+    return client.deserialize(data + offsets[i], offsets[i + 1] - offsets[i]);
+}
@@ -0,0 +1,45 @@
+#ifndef SPILLRUN_H
+#define SPILLRUN_H
+#include "MapReduceClient.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * A sorted run of intermediate pairs spilled to a local file.
+ *
+ * The pairs are stored as the records written by the client's serialize, one
+ * after another, and the file is mapped read-only, so reading a record costs
+ * no system call and its pages can be dropped by the kernel under memory
+ * pressure. The file is unlinked as soon as it is created, so it disappears
+ * with the run (or the process).
+ */
+class SpillRun {
+public:
+    ~SpillRun();
+
+    /**
+     * Serializes the pairs, in order, to a new file in `directory` (TMPDIR or
+     * /tmp when null). Returns null, writing nothing, if the client does not
+     * serialize pairs. Exits if the file cannot be written.
+     */
+    static SpillRun* write(const MapReduceClient& client,
+                           const IntermediateVec& pairs,
+                           const char* directory);
+
+    size_t size() const { return offsets.size() - 1; }
+
+    /**
+     * Rebuilds record i as new objects (see MapReduceClient::deserialize).
+     */
+    IntermediatePair read(const MapReduceClient& client, size_t i) const;
+
+private:
+    SpillRun() : data(nullptr), bytes(0) { }
+
+    const char* data;
+    size_t bytes;
+    // record i spans [offsets[i], offsets[i + 1]) of data.
+    std::vector<uint64_t> offsets;
+};
+
+#endif // SPILLRUN_H
@@ -0,0 +1,199 @@
+#include "ThreadPool.h"
+#include "Topology.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <system_error>
+#include <pthread.h>
+#include <sched.h>
+
+#define SYSTEM_ERROR_PREFIX "system error: "
+#define WORKER_ERROR "failed to start a pool worker"
+#define EXIT_FAIL 1
+#define STRIDE_SCALE (1 << 20)
+
+struct Task {
+    std::function<void()> run;
+    // The node the task would rather run on, or -1.
+    int node;
+};
+
+struct ThreadPool::TaskQueue {
+    std::deque<Task> tasks;
+    uint64_t pass;
+    uint64_t stride;
+};
+
+/**
+ * Pins a thread to one cpu. Returns false if the kernel refuses, e.g. for a
+ * cpu outside the process's cpuset.
+ */
+static bool pinThread(std::thread& thread, int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+}
+
+ThreadPool::ThreadPool(int numThreads, const std::vector<int>& cpus)
+        : ThreadPool(numThreads, cpus,
+                     cpus.empty() ? std::vector<int>() : readCpuNodes())
+{
+}
+
+/**
+ * Starts the workers, pinning worker i to cpus[i % cpus.size()] if cpus is
+ * not empty. A worker that cannot be pinned runs unpinned, on no node.
+ * The workers wait for the lock held here, so they see their nodes.
+ * Exits if a worker thread cannot be created.
+ */
+ThreadPool::ThreadPool(int numThreads, const std::vector<int>& cpus,
+                       const std::vector<int>& cpuNodes)
+        : pendingTasks(0)
+        , currentPass(0)
+        , stopping(false)
+{
+    std::vector<int> denseNodes;
+    if (!cpus.empty()) {
+        std::vector<int> known;
+        for (int node : cpuNodes) {
+            if (node >= 0) {
+                known.push_back(node);
+            }
+        }
+        std::sort(known.begin(), known.end());
+        known.erase(std::unique(known.begin(), known.end()), known.end());
+        denseNodes.assign(known.empty() ? 0 : known.back() + 1, -1);
+        for (size_t i = 0; i < known.size(); ++i) {
+            denseNodes[known[i]] = static_cast<int>(i);
+        }
+    }
+
+    std::vector<int> workerNodes(numThreads, -1);
+    std::unique_lock<std::mutex> lock(mutex);
+    for (int i = 0; i < numThreads; ++i) {
+        try {
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+        } catch (const std::system_error& e) {
+            std::cerr << SYSTEM_ERROR_PREFIX << WORKER_ERROR << std::endl;
+            exit(EXIT_FAIL);
+        }
+        if (cpus.empty()) {
+            continue;
+        }
+        int cpu = cpus[i % cpus.size()];
+        if (!pinThread(workers.back(), cpu)) {
+            continue;
+        }
+        // Without NUMA information every pinned worker is on node 0.
+        int node = 0;
+        if (!denseNodes.empty()) {
+            node = static_cast<size_t>(cpu) < cpuNodes.size() && cpuNodes[cpu] >= 0
+                       ? denseNodes[cpuNodes[cpu]] : -1;
+        }
+        workerNodes[i] = node;
+        if (node >= 0) {
+            if (nodeWorkers.size() <= static_cast<size_t>(node)) {
+                nodeWorkers.resize(node + 1, 0);
+            }
+            nodeWorkers[node]++;
+        }
+    }
+    // Nodes with no pinned worker are dropped from the numbering.
+    std::vector<int> renumbered(nodeWorkers.size(), -1);
+    int used = 0;
+    for (size_t node = 0; node < nodeWorkers.size(); ++node) {
+        if (nodeWorkers[node] > 0) {
+            nodeWorkers[used] = nodeWorkers[node];
+            renumbered[node] = used++;
+        }
+    }
+    nodeWorkers.resize(used);
+    for (int& node : workerNodes) {
+        node = node >= 0 ? renumbered[node] : -1;
+    }
+    this->workerNodes.swap(workerNodes);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+ThreadPool::TaskQueue* ThreadPool::createQueue(int weight) {
+    TaskQueue* queue = new TaskQueue();
+    queue->stride = STRIDE_SCALE / std::max(1, weight);
+    std::lock_guard<std::mutex> lock(mutex);
+    queue->pass = currentPass;
+    queues.push_back(queue);
+    return queue;
+}
+
+void ThreadPool::destroyQueue(TaskQueue* queue) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queues.erase(std::find(queues.begin(), queues.end(), queue));
+    }
+    delete queue;
+}
+
+void ThreadPool::submit(TaskQueue* queue, std::function<void()> task, int node) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue->tasks.empty()) {
+            queue->pass = std::max(queue->pass, currentPass);
+        }
+        queue->tasks.push_back(Task{std::move(task), node});
+        pendingTasks++;
+    }
+    cv.notify_one();
+}
+
+ThreadPool::TaskQueue* ThreadPool::nextQueue() {
+    TaskQueue* next = nullptr;
+    for (TaskQueue* queue : queues) {
+        if (!queue->tasks.empty() && (next == nullptr || queue->pass < next->pass)) {
+            next = queue;
+        }
+    }
+    return next;
+}
+
+void ThreadPool::workerLoop(int index) {
+    std::unique_lock<std::mutex> lock(mutex);
+    int node = workerNodes[index];
+    while (true) {
+        cv.wait(lock, [this] { return stopping || pendingTasks > 0; });
+        if (pendingTasks == 0) {
+            return;
+        }
+        TaskQueue* queue = nextQueue();
+        auto next = queue->tasks.begin();
+        if (node >= 0) {
+            auto local = std::find_if(queue->tasks.begin(), queue->tasks.end(),
+                                      [node](const Task& task) {
+                                          return task.node < 0 || task.node == node;
+                                      });
+            if (local != queue->tasks.end()) {
+                next = local;
+            }
+        }
+        std::function<void()> task = std::move(next->run);
+        queue->tasks.erase(next);
+        pendingTasks--;
+        currentPass = queue->pass;
+        queue->pass += queue->stride;
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads shared by many task queues (one per job).
+ *
+ * Workers pick tasks by stride scheduling: every queue has a pass value that
+ * grows by STRIDE_SCALE / weight for each task it runs, and the non-empty
+ * queue with the lowest pass runs next. Busy queues thus share the workers
+ * in proportion to their weights, and a queue that was idle rejoins at the
+ * current pass instead of catching up on the turns it missed.
+ *
+ * Workers can be pinned to cpus, one cpu each, round robin over the list
+ * given. A task may name the NUMA node it would rather run on: a pinned
+ * worker takes the first task of the chosen queue that is for its own node
+ * (or for none), and only takes another node's task when there is none.
+ *
+ * A task runs to its end once picked, so queues share the workers only as
+ * finely as their tasks allow. The framework's map and reduce tasks stop
+ * after a time slice of about 2ms, but the sort that ends a worker's map
+ * and its shuffle, merge and output tasks run whole, holding their worker
+ * from every other queue until they end.
+ *
+ * Tasks must not block waiting for other tasks, since the pool never grows.
+ */
+class ThreadPool {
+public:
+    struct TaskQueue;
+
+    explicit ThreadPool(int numThreads,
+                        const std::vector<int>& cpus = std::vector<int>());
+
+    /**
+     * Like the above, with the NUMA node of every cpu given, as readCpuNodes
+     * returns it, instead of read from the kernel.
+     */
+    ThreadPool(int numThreads, const std::vector<int>& cpus,
+               const std::vector<int>& cpuNodes);
+    ~ThreadPool();
+    TaskQueue* createQueue(int weight);
+    void destroyQueue(TaskQueue* queue);
+    void submit(TaskQueue* queue, std::function<void()> task, int node = -1);
+
+    /**
+     * Returns how many of the pool's workers are pinned to each node. Nodes
+     * are numbered densely from 0 in order of their kernel numbers, and only
+     * nodes holding a pinned worker count. Empty when no worker is pinned.
+     */
+    const std::vector<int>& workersPerNode() const { return nodeWorkers; }
+
+private:
+    void workerLoop(int index);
+    TaskQueue* nextQueue();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<TaskQueue*> queues;
+    std::vector<std::thread> workers;
+    // The node each worker is pinned to, or -1.
+    std::vector<int> workerNodes;
+    std::vector<int> nodeWorkers;
+    size_t pendingTasks;
+    uint64_t currentPass;
+    bool stopping;
+};
+
+/**
+ * Returns the process-wide pool that runs the workers of every job, of
+ * MapReduceFramework.h and MapReduceJob alike (see MapReduceFramework.cpp).
+ */
+ThreadPool& sharedPool();
+
+#endif // THREADPOOL_H
@@ -0,0 +1,74 @@
+#include "Topology.h"
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <string>
+
+#define NODE_DIRECTORY "/sys/devices/system/node"
+#define NODE_PREFIX "node"
+
+/**
+ * Sets the node of every cpu in a kernel cpu list such as "0-3,8,10-11".
+ */
+static void markCpuList(const std::string& list, int node, std::vector<int>& nodes)
+{
+    size_t position = 0;
+    while (position < list.size()) {
+        char* end;
+        long first = std::strtol(list.c_str() + position, &end, 10);
+        if (end == list.c_str() + position || first < 0) {
+            return;
+        }
+        long last = first;
+        if (*end == '-') {
+            const char* rangeEnd = end + 1;
+            last = std::strtol(rangeEnd, &end, 10);
+            if (end == rangeEnd || last < first) {
+                return;
+            }
+        }
+        if (nodes.size() <= static_cast<size_t>(last)) {
+            nodes.resize(last + 1, -1);
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            nodes[cpu] = node;
+        }
+        position = end - list.c_str();
+        if (position < list.size() && list[position] == ',') {
+            ++position;
+        } else {
+            return;
+        }
+    }
+}
+
+std::vector<int> readCpuNodes()
+{
+    return readCpuNodes(NODE_DIRECTORY);
+}
+
+std::vector<int> readCpuNodes(const char* path)
+{
+    std::vector<int> nodes;
+    DIR* directory = opendir(path);
+    if (directory == nullptr) {
+        return nodes;
+    }
+    while (struct dirent* entry = readdir(directory)) {
+        std::string name(entry->d_name);
+        if (name.compare(0, sizeof(NODE_PREFIX) - 1, NODE_PREFIX) != 0 ||
+            name.size() == sizeof(NODE_PREFIX) - 1 ||
+            name.find_first_not_of("0123456789", sizeof(NODE_PREFIX) - 1) !=
+                std::string::npos) {
+            continue;
+        }
+        int node = std::atoi(name.c_str() + sizeof(NODE_PREFIX) - 1);
+        std::ifstream file(std::string(path) + "/" + name + "/cpulist");
+        std::string list;
+        if (std::getline(file, list)) {
+            markCpuList(list, node, nodes);
+        }
+    }
+    closedir(directory);
+    return nodes;
+}
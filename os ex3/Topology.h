@@ -0,0 +1,19 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+#include <vector>
+
+/**
+ * Returns the NUMA node of every online cpu, indexed by cpu number, as
+ * listed under /sys/devices/system/node. Cpus the kernel lists under no node
+ * get -1. Returns an empty vector when the kernel exposes no NUMA
+ * information (e.g. a kernel built without NUMA support).
+ */
+std::vector<int> readCpuNodes();
+
+/**
+ * Like readCpuNodes, from a directory laid out like /sys/devices/system/node
+ * (one nodeN directory per node, holding a cpulist file).
+ */
+std::vector<int> readCpuNodes(const char* directory);
+
+#endif // TOPOLOGY_H
@@ -0,0 +1,36 @@
+#ifndef WORKCLAIM_H
+#define WORKCLAIM_H
+#include <atomic>
+#include <cstdint>
+
+#define GUIDED_CHUNK_DIVISOR 2
+
+/**
+ * Claims the next chunk [begin, begin + size) of the work units counted by
+ * a counter shared by `workers` workers, and returns its size (0 once all
+ * `total` units are claimed).
+ *
+ * Uses guided scheduling: a claim takes remaining / (GUIDED_CHUNK_DIVISOR *
+ * workers) units, at least one. Early chunks are big, so the shared counter
+ * is touched O(workers * log(total)) times rather than once per unit, and
+ * chunks shrink to single units near the tail, where load balance matters.
+ */
+inline uint64_t claimChunk(std::atomic<uint64_t>& next, uint64_t total,
+                           int workers, uint64_t& begin)
+{
+  uint64_t current = next.load(std::memory_order_relaxed);
+  while (current < total) {
+    uint64_t size = (total - current) / (GUIDED_CHUNK_DIVISOR * workers);
+    if (size == 0) {
+      size = 1;
+    }
+    if (next.compare_exchange_weak(current, current + size,
+                                   std::memory_order_relaxed)) {
+      begin = current;
+      return size;
+    }
+  }
+  return 0;
+}
+
+#endif // WORKCLAIM_H